@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "dgram_batch.h"
+
+#define BVLL_TYPE_BIP		    0x81
+#define BVLC_FORWARDED_NPDU	    0x04
+#define BVLC_ORIGINAL_UNICAST	    0x0A
+#define BVLC_ORIGINAL_BROADCAST	    0x0B
+
+#define BENCH_PACKETS		    (1 << 20)
+#define BENCH_NPDU_LENGTH	    17	    /* A ReadProperty request */
+#define BENCH_RCVBUF		    (4 << 20)
+#define BENCH_TIMEOUT_MS	    100	    /* Before a burst counts as lost */
+
+/* The buffers are allocated once and reused for every batch */
+void dgram_batch_init(dgram_batch *batch, int fd, unsigned size, size_t mtu) {
+    unsigned i;
+
+    memset(batch, 0, sizeof(*batch));
+    batch->fd = fd;
+    batch->size = size;
+    batch->mtu = mtu;
+
+    batch->data = malloc(size * mtu);
+    batch->addrs = calloc(size, sizeof(*batch->addrs));
+    batch->iovs = calloc(size, sizeof(*batch->iovs));
+    batch->msgs = calloc(size, sizeof(*batch->msgs));
+    if (!batch->data || !batch->addrs || !batch->iovs || !batch->msgs) {
+	fprintf(stderr, "Error allocating datagram batch\n");
+	exit(1);
+    }
+
+    for (i = 0; i < size; i++) {
+	batch->iovs[i].iov_base = batch->data + i * mtu;
+	batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+	batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+	batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+void dgram_batch_free(dgram_batch *batch) {
+    free(batch->data);
+    free(batch->addrs);
+    free(batch->iovs);
+    free(batch->msgs);
+    memset(batch, 0, sizeof(*batch));
+}
+
+/* Reads whatever is waiting on the socket, up to one batch, without
+ * blocking. Returns the number of datagrams read, or -1 on error */
+int dgram_recv(dgram_batch *batch) {
+    unsigned i;
+    int n;
+
+    for (i = 0; i < batch->size; i++) {
+	batch->iovs[i].iov_len = batch->mtu;
+	batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+    }
+
+    batch->count = 0;
+    n = recvmmsg(batch->fd, batch->msgs, batch->size, MSG_DONTWAIT, NULL);
+    batch->calls++;
+    if (n < 0)
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ?
+		0 : -1;
+
+    batch->count = n;
+    batch->datagrams += n;
+    return n;
+}
+
+/* Finds the NPDU in received datagram i and the BACnet/IP address it
+ * originated from. Returns the NPDU length, or 0 if the datagram doesn't
+ * carry one, such as BVLC-Result or BBMD management messages */
+int dgram_bvlc_decode(dgram_batch *batch, unsigned i,
+		struct sockaddr_in *src, uint8_t **npdu) {
+    uint8_t *data = batch->iovs[i].iov_base;
+    unsigned len = batch->msgs[i].msg_len;
+
+    if (len < DGRAM_BVLC_HEADER || data[0] != BVLL_TYPE_BIP ||
+	    ((data[2] << 8) | data[3]) != len)
+	return 0;
+
+    switch (data[1]) {
+	case BVLC_ORIGINAL_UNICAST:
+	case BVLC_ORIGINAL_BROADCAST:
+	    *src = batch->addrs[i];
+	    *npdu = data + DGRAM_BVLC_HEADER;
+	    return len - DGRAM_BVLC_HEADER;
+
+	case BVLC_FORWARDED_NPDU:
+	    /* The originating address follows the header */
+	    if (len < DGRAM_BVLC_HEADER + 6) return 0;
+	    memset(src, 0, sizeof(*src));
+	    src->sin_family = AF_INET;
+	    memcpy(&src->sin_addr.s_addr, data + 4, 4);
+	    memcpy(&src->sin_port, data + 8, 2);
+	    *npdu = data + DGRAM_BVLC_HEADER + 6;
+	    return len - DGRAM_BVLC_HEADER - 6;
+    }
+    return 0;
+}
+
+/* The BVLC header of an Original-Unicast-NPDU datagram of len bytes */
+void dgram_bvlc_header(uint8_t *data, size_t len) {
+    data[0] = BVLL_TYPE_BIP;
+    data[1] = BVLC_ORIGINAL_UNICAST;
+    data[2] = len >> 8;
+    data[3] = len & 0xff;
+}
+
+/* Frames an NPDU as a BVLC Original-Unicast-NPDU and queues it, sending the
+ * batch first if it's full. Returns the number of bytes queued, or -1 */
+int dgram_bvlc_queue(dgram_batch *batch,
+		const struct sockaddr_in *dest,
+		const uint8_t *npdu, size_t len) {
+    uint8_t *data;
+    size_t mtu_len = len + DGRAM_BVLC_HEADER;
+
+    if (mtu_len > batch->mtu) return -1;
+    if (batch->count == batch->size && dgram_flush(batch) < 0) return -1;
+
+    data = batch->iovs[batch->count].iov_base;
+    dgram_bvlc_header(data, mtu_len);
+    memcpy(data + DGRAM_BVLC_HEADER, npdu, len);
+
+    batch->iovs[batch->count].iov_len = mtu_len;
+    batch->addrs[batch->count] = *dest;
+    batch->msgs[batch->count].msg_hdr.msg_namelen = sizeof(*dest);
+    batch->count++;
+    return mtu_len;
+}
+
+/* Sends everything queued. sendmmsg() may stop short, so keep going until
+ * the batch is empty or the socket fails. Returns the number sent, or -1 */
+int dgram_flush(dgram_batch *batch) {
+    unsigned sent = 0;
+    int n, ret = 0;
+
+    while (sent < batch->count) {
+	n = sendmmsg(batch->fd, batch->msgs + sent, batch->count - sent, 0);
+	batch->calls++;
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    fprintf(stderr, "Error sending datagrams: %s\n", strerror(errno));
+	    ret = -1;
+	    break;
+	}
+	sent += n;
+    }
+
+    batch->datagrams += sent;
+    batch->count = 0;
+    return ret < 0 ? ret : (int) sent;
+}
+
+static unsigned link_size;
+static dgram_batch link_rx, link_tx;
+static int link_batching;
+static uint8_t link_my_mac[6];
+static dgram_send_pdu_func link_send_direct;
+
+/* Packets and calls through libbacnet's datalink since the last report */
+static unsigned long link_direct_rx, link_direct_tx;
+
+/* fd is the BACnet/IP socket, mtu the largest BVLC message. Received
+ * datagrams are only batched if receive is set */
+void dgram_link_init(int fd, unsigned size, size_t mtu, int receive,
+		const BACNET_ADDRESS *my_address,
+		dgram_send_pdu_func send_direct) {
+    link_size = size;
+    link_send_direct = send_direct;
+    memcpy(link_my_mac, my_address->mac, 6);
+    if (!size) return;
+
+    if (receive) dgram_batch_init(&link_rx, fd, size, mtu);
+    dgram_batch_init(&link_tx, fd, size, mtu);
+}
+
+int dgram_link_send_pdu(BACNET_ADDRESS *dest, BACNET_NPDU_DATA *npdu_data,
+		uint8_t *pdu, unsigned pdu_len) {
+    struct sockaddr_in addr;
+
+    if (!link_batching || dest->mac_len != 6 ||
+	    dest->net == BACNET_BROADCAST_NETWORK ||
+	    (dest->net && !dest->len)) {
+	link_direct_tx++;
+	return link_send_direct(dest, npdu_data, pdu, pdu_len);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    memcpy(&addr.sin_addr.s_addr, &dest->mac[0], 4);
+    memcpy(&addr.sin_port, &dest->mac[4], 2);
+    return dgram_bvlc_queue(&link_tx, &addr, pdu, pdu_len);
+}
+
+/* Queue unicast sends until dgram_link_end() */
+void dgram_link_begin(void) {
+    link_batching = link_size != 0;
+}
+
+void dgram_link_end(void) {
+    link_batching = 0;
+    if (link_size) dgram_flush(&link_tx);
+}
+
+/* Handles whatever is waiting on the socket. Returns the number of datagrams
+ * read */
+int dgram_link_receive(dgram_npdu_func handler) {
+    struct sockaddr_in addr;
+    BACNET_ADDRESS src;
+    uint8_t *npdu;
+    int i, n, len;
+
+    if ((n = dgram_recv(&link_rx)) < 0) {
+	fprintf(stderr, "Error receiving datagrams: %s\n", strerror(errno));
+	return 0;
+    }
+
+    dgram_link_begin();
+    for (i = 0; i < n; i++) {
+	if (!(len = dgram_bvlc_decode(&link_rx, i, &addr, &npdu))) continue;
+
+	memset(&src, 0, sizeof(src));
+	src.mac_len = 6;
+	memcpy(&src.mac[0], &addr.sin_addr.s_addr, 4);
+	memcpy(&src.mac[4], &addr.sin_port, 2);
+
+	/* Ignore our own broadcasts */
+	if (!memcmp(src.mac, link_my_mac, 6)) continue;
+
+	/* May call any registered handler */
+	handler(&src, npdu, len);
+    }
+    dgram_link_end();
+
+    return n;
+}
+
+/* Count a packet received through libbacnet's datalink */
+void dgram_link_received_direct(void) {
+    link_direct_rx++;
+}
+
+void dgram_link_report(unsigned seconds) {
+    unsigned long rx = link_rx.datagrams + link_direct_rx;
+    unsigned long tx = link_tx.datagrams + link_direct_tx;
+    unsigned long rx_calls = link_rx.calls + link_direct_rx;
+    unsigned long tx_calls = link_tx.calls + link_direct_tx;
+
+    fprintf(stderr, "BACnet/IP: batch %u, received %.1f packets/s "
+		    "(%.1f per call), sent %.1f packets/s (%.1f per call)\n",
+		    link_size,
+		    (double) rx / seconds, rx_calls ? (double) rx / rx_calls : 0,
+		    (double) tx / seconds, tx_calls ? (double) tx / tx_calls : 0);
+
+    link_rx.datagrams = link_rx.calls = link_direct_rx = 0;
+    link_tx.datagrams = link_tx.calls = link_direct_tx = 0;
+}
+
+static int bench_socket(struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int fd, rcvbuf = BENCH_RCVBUF;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+		bind(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+		getsockname(fd, (struct sockaddr *) addr, &len) < 0) {
+	fprintf(stderr, "Unable to create benchmark socket: %s\n",
+			strerror(errno));
+	exit(1);
+    }
+
+    /* Best effort: a whole burst should fit in the receive queue */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    return fd;
+}
+
+/* Send BENCH_PACKETS BVLC messages from one loopback socket to another, in
+ * bursts of size, and receive them. Returns the rate in packets/s. With
+ * batched set each burst is one sendmmsg() and as few recvmmsg() as it
+ * takes, otherwise one sendto() and one recvfrom() per packet */
+static double bench_run(int tx_fd, int rx_fd, const struct sockaddr_in *dest,
+		unsigned size, int batched, unsigned long *received,
+		unsigned long *calls) {
+    uint8_t npdu[BENCH_NPDU_LENGTH], buf[DGRAM_BVLC_HEADER + sizeof(npdu)];
+    dgram_batch tx, rx;
+    struct pollfd pfd = { .fd = rx_fd, .events = POLLIN };
+    struct timespec start, end;
+    unsigned long sent;
+    unsigned i, burst;
+    int n;
+
+    memset(npdu, 0, sizeof(npdu));
+    memset(buf, 0, sizeof(buf));
+    dgram_batch_init(&tx, tx_fd, size, sizeof(buf));
+    dgram_batch_init(&rx, rx_fd, size, sizeof(buf));
+    *received = *calls = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (sent = 0; sent < BENCH_PACKETS; sent += size) {
+	if (batched) {
+	    for (i = 0; i < size; i++)
+		dgram_bvlc_queue(&tx, dest, npdu, sizeof(npdu));
+	    dgram_flush(&tx);
+	} else {
+	    for (i = 0; i < size; i++) {
+		sendto(tx_fd, buf, sizeof(buf), 0,
+				(const struct sockaddr *) dest, sizeof(*dest));
+		(*calls)++;
+	    }
+	}
+
+	/* Anything not received in time was dropped */
+	for (burst = 0; burst < size; burst += n) {
+	    if (poll(&pfd, 1, BENCH_TIMEOUT_MS) <= 0) break;
+	    if (batched) {
+		n = dgram_recv(&rx);
+	    } else {
+		n = recv(rx_fd, buf, sizeof(buf), MSG_DONTWAIT) < 0 ? 0 : 1;
+		(*calls)++;
+	    }
+	}
+	*received += burst;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (batched) *calls = tx.calls + rx.calls;
+    dgram_batch_free(&tx);
+    dgram_batch_free(&rx);
+
+    return *received / ((end.tv_sec - start.tv_sec) +
+		    (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+/* Loopback throughput with one system call per packet, as libbacnet's
+ * datalink does, against batches of size */
+void dgram_benchmark(unsigned size) {
+    struct sockaddr_in tx_addr, rx_addr;
+    unsigned long received, calls;
+    double single, batched;
+    int tx_fd, rx_fd;
+
+    tx_fd = bench_socket(&tx_addr);
+    rx_fd = bench_socket(&rx_addr);
+
+    single = bench_run(tx_fd, rx_fd, &rx_addr, size, 0, &received, &calls);
+    printf("Per packet: %.0f packets/s, %lu of %u received, "
+		    "%.2f packets per call\n", single, received,
+		    BENCH_PACKETS, (double) received / calls);
+
+    batched = bench_run(tx_fd, rx_fd, &rx_addr, size, 1, &received, &calls);
+    printf("Batch %u: %.0f packets/s, %lu of %u received, "
+		    "%.2f packets per call\n", size, batched, received,
+		    BENCH_PACKETS, (double) received / calls);
+
+    printf("Speedup %.2fx\n", batched / single);
+    close(tx_fd);
+    close(rx_fd);
+}
@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <libbacnet/datalink.h>
+
+/* BACnet/IP datagrams read with one recvmmsg() or written with one sendmmsg()
+ * per batch, into a ring of preallocated buffers */
+
+#define DGRAM_BATCH_MAX		    1024    /* UIO_MAXIOV, the kernel limit */
+#define DGRAM_BVLC_HEADER	    4	    /* Original-Unicast/Broadcast */
+
+typedef struct dgram_batch_s dgram_batch;
+struct dgram_batch_s {
+    int fd;
+    unsigned size;		    /* Datagrams per system call */
+    unsigned count;		    /* Datagrams received, or queued to send */
+    size_t mtu;
+
+    uint8_t *data;		    /* size buffers of mtu bytes */
+    struct sockaddr_in *addrs;
+    struct iovec *iovs;
+    struct mmsghdr *msgs;
+
+    /* Totals for rate reporting */
+    unsigned long datagrams;
+    unsigned long calls;
+};
+
+extern void dgram_batch_init(
+		dgram_batch *batch, int fd, unsigned size, size_t mtu);
+extern void dgram_batch_free(dgram_batch *batch);
+
+extern int dgram_recv(dgram_batch *batch);
+extern int dgram_bvlc_decode(dgram_batch *batch, unsigned i,
+		struct sockaddr_in *src, uint8_t **npdu);
+
+extern void dgram_bvlc_header(uint8_t *data, size_t len);
+extern int dgram_bvlc_queue(dgram_batch *batch,
+		const struct sockaddr_in *dest,
+		const uint8_t *npdu, size_t len);
+extern int dgram_flush(dgram_batch *batch);
+
+/* Batched BACnet/IP datalink, shared by bacnet_client and bacnet_server.
+ * dgram_link_send_pdu() replaces libbacnet's datalink_send_pdu. While a batch
+ * is open, unicast sends are queued and sent together with sendmmsg() when
+ * it closes. Anything else goes through libbacnet's datalink as before.
+ * dgram_link_receive() reads up to a batch of datagrams with recvmmsg() and
+ * hands each NPDU to the handler with a batch open. With a batch size of 0
+ * libbacnet's datalink is used for everything, giving the baseline for the
+ * packet rate report. The link is not thread safe, callers serialise it.
+ *
+ * Unless it registers with a BBMD as a foreign device, libbacnet's BVLC layer
+ * acts as a BBMD and has to see every BVLC message itself, so received
+ * datagrams should only be batched as a foreign device */
+typedef int (*dgram_send_pdu_func)(BACNET_ADDRESS *dest,
+		BACNET_NPDU_DATA *npdu_data, uint8_t *pdu, unsigned pdu_len);
+typedef void (*dgram_npdu_func)(BACNET_ADDRESS *src,
+		uint8_t *npdu, uint16_t len);
+
+extern void dgram_link_init(int fd, unsigned size, size_t mtu, int receive,
+		const BACNET_ADDRESS *my_address,
+		dgram_send_pdu_func send_direct);
+extern int dgram_link_send_pdu(BACNET_ADDRESS *dest,
+		BACNET_NPDU_DATA *npdu_data, uint8_t *pdu, unsigned pdu_len);
+
+extern void dgram_link_begin(void);
+extern void dgram_link_end(void);
+extern int dgram_link_receive(dgram_npdu_func handler);
+extern void dgram_link_received_direct(void);
+extern void dgram_link_report(unsigned seconds);
+
+extern void dgram_benchmark(unsigned size);
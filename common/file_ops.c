@@ -4,6 +4,11 @@
 #include <dirent.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "file_ops.h"
@@ -16,7 +21,7 @@ typedef struct random_channel_data_s random_channel_obj;
 struct random_channel_data_s {
     size_t num_words;
     size_t index;
-    uint16_t *data;
+    const uint16_t *data;	/* Read only file mapping */
 
     list_entry channels;
 };
@@ -53,8 +58,9 @@ static void add_device_data(const char *location, random_device_obj *device) {
     struct dirent **dir_contents;
     random_channel_obj *channel;
     char *data_filename;
-    FILE *fp;
-    size_t file_size, bytes;
+    struct stat st;
+    size_t file_size;
+    int fd;
 
     INIT_LIST_HEAD(&device->channels);
     device->num_regs = 0;
@@ -73,23 +79,27 @@ static void add_device_data(const char *location, random_device_obj *device) {
 	    exit(1);
 	}
 
-	fp = fopen(data_filename, "r");
-	fseek(fp, 0, SEEK_END);
-	file_size = ftell(fp);
-	rewind(fp);
+	if ((fd = open(data_filename, O_RDONLY | O_CLOEXEC)) < 0 ||
+			fstat(fd, &st) < 0) {
+	    fprintf(stderr, "Unable to open %s: %s\n",
+			    data_filename, strerror(errno));
+	    exit(1);
+	}
+	file_size = st.st_size;
 
-	/* File size should be aligned to uint16_t */
-	if (file_size % 2) {
+	/* File size should be aligned to uint16_t, and readers expect at least
+	 * one word */
+	if (!file_size || file_size % 2) {
 	    fprintf(stderr, "Illegal file size for %s\n", data_filename);
 	    exit(1);
 	}
 
-	channel->data = malloc(file_size);
-	bytes = fread(channel->data, 1, file_size, fp);
-
-	if (bytes != file_size) {
-	    fprintf(stderr, "Incomplete read for %s: %li\n", 
-			    data_filename, bytes);
+	/* The data is never written, so it's mapped rather than read. Every
+	 * process using the pool shares the same page cache */
+	channel->data = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (channel->data == MAP_FAILED) {
+	    fprintf(stderr, "Unable to map %s: %s\n",
+			    data_filename, strerror(errno));
 	    exit(1);
 	}
 
@@ -106,7 +116,7 @@ static void add_device_data(const char *location, random_device_obj *device) {
 	    }
 	}
 
-	fclose(fp);
+	close(fd);
 	free(data_filename);
 	free(dir_contents[i]);
     }
@@ -248,8 +258,15 @@ void file_device_enumerate(void (*add_device_func)(int device_id)) {
     enum_device = NULL;
 }
 
+/* The number of channels file_channel_enumerate() will visit */
+int file_channel_count(void) {
+    return enum_device ? enum_device->num_regs : 0;
+}
+
+/* data stays valid until file_free_random_data() */
 void file_channel_enumerate(
-	void (*add_channel_func)(size_t num_words, uint16_t *data, void *arg),
+	void (*add_channel_func)(size_t num_words, const uint16_t *data,
+		void *arg),
 	void *arg) {
     random_channel_obj *channel;
 
@@ -261,11 +278,14 @@ void file_channel_enumerate(
 }
 
 void file_free_random_data(void) {
-    random_device_obj *device;
-    random_channel_obj *channel;
-
-    list_for_each_entry(device, &devices, devices) {
-	list_for_each_entry(channel, &device->channels, channels) {
+    random_device_obj *device, *next_device;
+    random_channel_obj *channel, *next_channel;
+
+    list_for_each_entry_safe(device, next_device, &devices, devices) {
+	list_for_each_entry_safe(channel, next_channel,
+			&device->channels, channels) {
+	    munmap((void *) channel->data,
+			    channel->num_words * sizeof(uint16_t));
 	    free(channel);
 	}
 	free(device);
@@ -7,8 +7,10 @@ extern void file_print_random_data();
 extern void file_update_regs(uint16_t *regs, int device_id);
 
 extern void file_device_enumerate(void (*add_device_func)(int device_id));
+extern int file_channel_count(void);
 extern void file_channel_enumerate(
-	void (*add_channel_func)(size_t num_words, uint16_t *data, void *arg),
+	void (*add_channel_func)(size_t num_words, const uint16_t *data,
+		void *arg),
 	void *arg);
 
 extern int file_num_devices(void);
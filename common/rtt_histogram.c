@@ -0,0 +1,19 @@
+#include "rtt_histogram.h"
+
+/* The bucket counting a round trip time */
+unsigned rtt_histogram_bucket(unsigned long us) {
+    unsigned exp, bucket;
+
+    if (us < 8) return us;
+
+    exp = 8 * sizeof(us) - 1 - __builtin_clzl(us);
+    bucket = 8 * (exp - 2) + ((us >> (exp - 3)) & 7);
+    return bucket < RTT_HISTOGRAM_BUCKETS ?
+	    bucket : RTT_HISTOGRAM_BUCKETS - 1;
+}
+
+/* The smallest round trip time in a bucket */
+unsigned long rtt_histogram_bucket_us(unsigned bucket) {
+    if (bucket < 8) return bucket;
+    return (8UL + (bucket & 7)) << (bucket / 8 - 1);
+}
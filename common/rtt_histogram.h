@@ -0,0 +1,8 @@
+/* Round trip times are counted in a log-linear histogram: 1 us buckets up to
+ * 8 us, then 8 buckets per power of 2, so a percentile is within 12.5%. The
+ * last bucket also holds every time beyond it */
+
+#define RTT_HISTOGRAM_BUCKETS	    192	    /* Up to a minute */
+
+extern unsigned rtt_histogram_bucket(unsigned long us);
+extern unsigned long rtt_histogram_bucket_us(unsigned bucket);
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_regs.h"
+
+#define SHM_REGS_MAGIC		    0x52474d53	/* "SMGR" */
+#define SHM_REGS_VERSION	    2
+
+#define SHM_REGS_SIZE(pages) \
+    (sizeof(shm_regs_header) + (pages) * sizeof(shm_regs_page))
+
+static int futex(uint32_t *word, int op, uint32_t value,
+		const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static shm_regs *shm_regs_map(int fd, size_t size) {
+    shm_regs *regs;
+    void *base;
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    if (!(regs = malloc(sizeof(shm_regs)))) {
+	fprintf(stderr, "Error allocating shared registers\n");
+	exit(1);
+    }
+    regs->fd = fd;
+    regs->size = size;
+    regs->last_published_ns = 0;
+    regs->header = base;
+    regs->pages = (shm_regs_page *) (regs->header + 1);
+    return regs;
+}
+
+/* Publish a new region, replacing any previous one. Readers of the old
+ * region see that it has been unlinked and open this one */
+shm_regs *shm_regs_create(const char *path, unsigned num_regs) {
+    unsigned num_pages = (num_regs + SHM_REGS_PAGE - 1) / SHM_REGS_PAGE;
+    size_t size = SHM_REGS_SIZE(num_pages);
+    shm_regs *regs;
+    int fd;
+
+    unlink(path);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0 ||
+		ftruncate(fd, size) < 0 || !(regs = shm_regs_map(fd, size))) {
+	fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+	exit(1);
+    }
+
+    regs->header->version = SHM_REGS_VERSION;
+    regs->header->num_regs = num_regs;
+    regs->header->num_pages = num_pages;
+
+    /* Readers ignore the region until the magic number appears */
+    __atomic_store_n(&regs->header->magic, SHM_REGS_MAGIC, __ATOMIC_RELEASE);
+    return regs;
+}
+
+/* Returns NULL if there's no region yet */
+shm_regs *shm_regs_open(const char *path) {
+    shm_regs_header *header;
+    shm_regs *regs;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) return NULL;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(shm_regs_header) ||
+		!(regs = shm_regs_map(fd, st.st_size))) {
+	close(fd);
+	return NULL;
+    }
+
+    header = regs->header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) !=
+		SHM_REGS_MAGIC || header->version != SHM_REGS_VERSION ||
+		regs->size != SHM_REGS_SIZE(header->num_pages)) {
+	shm_regs_close(regs);
+	return NULL;
+    }
+
+    return regs;
+}
+
+void shm_regs_close(shm_regs *regs) {
+    munmap(regs->header, regs->size);
+    close(regs->fd);
+    free(regs);
+}
+
+/* True once the publisher has replaced or removed the region */
+int shm_regs_unlinked(shm_regs *regs) {
+    struct stat st;
+
+    return fstat(regs->fd, &st) < 0 || !st.st_nlink;
+}
+
+/* Only one process may write to a region, and its writes must be serialised.
+ * Every page the registers lie in is marked as being written before any of
+ * them changes, so a write is atomic even when it spans pages. Returns -1 if
+ * the registers are out of range */
+int shm_regs_write(shm_regs *regs, unsigned start, unsigned count,
+		const uint16_t *values) {
+    shm_regs_header *header = regs->header;
+    unsigned first, last, i, offset, n;
+    shm_regs_page *page;
+    struct timespec now;
+    uint64_t published_ns;
+
+    if (!count) return 0;
+    if (start + count > header->num_regs) return -1;
+
+    /* Two writes never share a time, so a register's time changes with
+     * every write of it */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    published_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    if (published_ns <= regs->last_published_ns)
+	published_ns = regs->last_published_ns + 1;
+    regs->last_published_ns = published_ns;
+
+    first = start / SHM_REGS_PAGE;
+    last = (start + count - 1) / SHM_REGS_PAGE;
+
+    for (i = first; i <= last; i++)
+	__atomic_store_n(&regs->pages[i].seq, regs->pages[i].seq + 1,
+			__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    while (count) {
+	page = &regs->pages[start / SHM_REGS_PAGE];
+	offset = start % SHM_REGS_PAGE;
+	n = SHM_REGS_PAGE - offset < count ? SHM_REGS_PAGE - offset : count;
+
+	memcpy(&page->regs[offset], values, n * sizeof(uint16_t));
+	for (i = offset; i < offset + n; i++)
+	    page->published_ns[i] = published_ns;
+
+	start += n;
+	values += n;
+	count -= n;
+    }
+
+    for (i = first; i <= last; i++)
+	__atomic_store_n(&regs->pages[i].seq, regs->pages[i].seq + 1,
+			__ATOMIC_RELEASE);
+
+    /* Only wake readers that are actually asleep */
+    __atomic_add_fetch(&header->changes, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST))
+	futex(&header->changes, FUTEX_WAKE, INT_MAX, NULL);
+
+    return 0;
+}
+
+/* Read a consistent copy of the registers and the time each was last
+ * written, retrying if any of the pages they lie in is written meanwhile. A
+ * register whose time hasn't changed since the last read hasn't been written
+ * since. Returns -1 if the registers are out of range */
+int shm_regs_read(shm_regs *regs, unsigned start, unsigned count,
+		uint16_t *values, uint64_t *published_ns) {
+    unsigned first, last, i, offset, n, left, reg;
+    uint16_t *dest;
+    uint64_t *dest_ns;
+    shm_regs_page *page;
+
+    if (!count) return -1;
+    if (start + count > regs->header->num_regs) return -1;
+
+    first = start / SHM_REGS_PAGE;
+    last = (start + count - 1) / SHM_REGS_PAGE;
+
+    {
+	uint32_t seqs[last - first + 1];
+
+retry:
+	for (i = first, reg = start, left = count, dest = values,
+			dest_ns = published_ns; i <= last; i++) {
+	    page = &regs->pages[i];
+
+	    /* The writer holds a page for as long as a memcpy takes */
+	    while ((seqs[i - first] =
+			    __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1);
+
+	    offset = reg % SHM_REGS_PAGE;
+	    n = SHM_REGS_PAGE - offset < left ? SHM_REGS_PAGE - offset : left;
+	    memcpy(dest, &page->regs[offset], n * sizeof(uint16_t));
+	    memcpy(dest_ns, &page->published_ns[offset],
+			    n * sizeof(uint64_t));
+
+	    reg += n;
+	    dest += n;
+	    dest_ns += n;
+	    left -= n;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	for (i = first; i <= last; i++)
+	    if (__atomic_load_n(&regs->pages[i].seq, __ATOMIC_RELAXED) !=
+			    seqs[i - first])
+		goto retry;
+    }
+
+    return 0;
+}
+
+uint32_t shm_regs_changes(shm_regs *regs) {
+    return __atomic_load_n(&regs->header->changes, __ATOMIC_ACQUIRE);
+}
+
+/* Sleep until the region is written after changes was read, or timeout_ms
+ * passes */
+void shm_regs_wait(shm_regs *regs, uint32_t changes, unsigned timeout_ms) {
+    shm_regs_header *header = regs->header;
+    struct timespec timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->changes, __ATOMIC_SEQ_CST) == changes)
+	futex(&header->changes, FUTEX_WAIT, changes, &timeout);
+    __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+}
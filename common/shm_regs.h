@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/* Holding registers shared between processes on one host. modbus_server
+ * publishes its registers to a file on tmpfs and bacnet_server maps the same
+ * file and reads them directly. The registers are divided into pages, each
+ * guarded by a sequence lock, so a reader never blocks the writer and a read
+ * costs no system calls. Each register also carries the time of the write
+ * that last set it, which changes with every write of that register, so
+ * readers can tell which of the registers they read are new. Every write
+ * bumps a change counter that readers can sleep on with a futex */
+
+#define SHM_REGS_PATH		    "/dev/shm/testbench_regs"
+#define SHM_REGS_PAGE		    1024    /* Registers per page */
+
+typedef struct shm_regs_header_s shm_regs_header;
+struct shm_regs_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_regs;
+    uint32_t num_pages;
+
+    uint32_t changes;		    /* Futex word, bumped by every write */
+    uint32_t waiters;		    /* Readers sleeping on changes */
+} __attribute__((aligned(64)));
+
+typedef struct shm_regs_page_s shm_regs_page;
+struct shm_regs_page_s {
+    uint32_t seq;		    /* Odd while being written */
+    uint32_t reserved;
+    uint16_t regs[SHM_REGS_PAGE];
+
+    /* CLOCK_MONOTONIC of each register's last write. Strictly increasing,
+     * so it also versions the register */
+    uint64_t published_ns[SHM_REGS_PAGE];
+} __attribute__((aligned(64)));
+
+typedef struct shm_regs_s shm_regs;
+struct shm_regs_s {
+    int fd;
+    size_t size;
+    shm_regs_header *header;
+    shm_regs_page *pages;
+    uint64_t last_published_ns;	    /* Writer only */
+};
+
+extern shm_regs *shm_regs_create(const char *path, unsigned num_regs);
+extern shm_regs *shm_regs_open(const char *path);
+extern void shm_regs_close(shm_regs *regs);
+extern int shm_regs_unlinked(shm_regs *regs);
+
+extern int shm_regs_write(shm_regs *regs, unsigned start, unsigned count,
+		const uint16_t *values);
+extern int shm_regs_read(shm_regs *regs, unsigned start, unsigned count,
+		uint16_t *values, uint64_t *published_ns);
+
+extern uint32_t shm_regs_changes(shm_regs *regs);
+extern void shm_regs_wait(shm_regs *regs, uint32_t changes,
+		unsigned timeout_ms);
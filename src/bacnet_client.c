@@ -11,13 +11,26 @@
 #include <libbacnet/bactext.h>
 #include "bacnet_namespace.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/prctl.h>
+
 #include "list.h"
 #include "file_ops.h"
+#include "dgram_batch.h"
+#include "rtt_histogram.h"
 
 #define BACNET_PORT		    0xBAC0
 #define BACNET_INTERFACE	    "lo"
 #define BACNET_DATALINK_TYPE	    "bvlc"
-#define BACNET_SELECT_TIMEOUT_MS    1	    /* ms */
+#define BACNET_SELECT_TIMEOUT_MS    1000    /* ms */
+#define BACNET_BATCH_SIZE	    32	    /* datagrams, 0 for no batching */
 
 #define RUN_AS_BBMD_CLIENT	    0
 
@@ -27,23 +40,106 @@
 #define BACNET_BBMD_TTL		    90
 #endif
 
+/* Sharding (-j). Shards after the first have their own ports and register
+ * with the first, as its foreign devices */
+#define SHARDS_MAX		    64
+#define SHARD_PORT_BASE		    0xBAD0
+#define SHARD_BBMD_TTL		    90
+
+/* Received datagrams are only batched as a foreign device, see
+ * dgram_link_init() */
+#define BATCH_RECEIVE		    (RUN_AS_BBMD_CLIENT || shard)
+
+/* Read_Property scheduling, see sched_complete() */
+#define SCHED_TICK_MS		    10	    /* Timer wheel resolution */
+#define SCHED_WHEEL_SLOTS	    256
+#define SCHED_INTERVAL_MS	    100	    /* Until a round trip is measured */
+#define SCHED_INTERVAL_MIN_MS	    20
+#define SCHED_INTERVAL_MAX_MS	    10000
+#define SCHED_TIMEOUT_CHECK_MS	    1000    /* The TSM timer's resolution */
+#define SCHED_WINDOW_INIT	    4	    /* Requests in flight per device */
+#define SCHED_WINDOW_MAX	    64
+#define SCHED_RTT_SLACK		    2	    /* Times the lowest round trip, */
+#define SCHED_RTT_SLACK_MS	    5	    /* plus this, means queueing */
+
+/* ReadPropertyMultiple polling (-p). Each Analog Input's Present_Value takes
+ * 16 bytes of the reply, which libbacnet servers won't segment */
+#define RPM_MAX_INSTANCES	    64
+
+/* COV subscriptions (-c, or -C for confirmed notifications) */
+#define COV_PROCESS_ID		    1
+#define COV_LIFETIME_S		    300
+#define COV_RENEW_MS		    240000  /* Well before the lifetime ends */
+#define COV_MAX_VALUES		    4	    /* Properties per notification */
+#define COV_UNCONFIRMED		    1
+#define COV_CONFIRMED		    2
+
+#define DEVICE_HASH_SIZE	    1024
+
+/* Device discovery, see ping_servers() */
+#define WHOIS_BACKOFF_MAX_S	    64
+#define WHOIS_RANGE_GAP		    16
+
+/* Statistics (-o), see stats_write() */
+#define STATS_PERIOD_S		    10
+
+/* Matcher benchmark (-k) */
+#define BENCH_SAMPLES		    (1 << 22)
+#define BENCH_ALPHABET		    4	    /* Values, so partial matches are common */
+#define BENCH_SHIFT_WORDS	    (1UL << 31) /* Limits shift and compare time */
+
 #define debug 0
 
 static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
-static int instance_no;
+static int rpm_mode;
+static int cov_mode;
+static unsigned shards = 1, shard;
 static LIST_HEAD(devices);
 
+typedef struct instance_obj_s instance_obj;
+
+typedef struct rtt_stats_s rtt_stats;
+struct rtt_stats_s {
+    unsigned long	count;
+    double		sum_ms;
+    double		max_ms;
+    uint32_t		buckets[RTT_HISTOGRAM_BUCKETS];
+};
+
 typedef struct device_obj_s device_obj;
 struct device_obj_s {
     int			found;
     uint32_t		device_id;
     BACNET_ADDRESS	bacnet_address;
     struct list_head	instances;
+    instance_obj	*by_no;		/* Instances by number, one array */
+    uint32_t		*prefixes;	/* Not yet used by its instances */
+    device_obj		*hash_next;
+
+    /* While not found, see ping_servers() */
+    unsigned		whois_backoff;	/* Seconds */
+    unsigned long	whois_due;
+    unsigned long	binds;		/* I-Am received while not found */
+
+    rtt_stats		rtt;		/* Of all its instances' requests */
+
+    /* Scheduling, see sched_complete() */
+    unsigned		num_instances;
+    unsigned		in_flight;
+    double		window;		/* Requests allowed in flight */
+    double		srtt_ms;	/* Smoothed round trip time */
+    double		min_rtt_ms;
+    unsigned long	backoff_tick;	/* Window not halved again until */
+    unsigned long	failures;	/* Since the last report */
+    struct list_head	pending;	/* Due, waiting for the window */
+
+    int			rpm;		/* Until it rejects ReadPropertyMultiple */
+    int			cov;		/* Until it rejects SubscribeCOV */
+    unsigned long	notifications;	/* Since the last report */
 
     list_entry		devices;
 };
 
-typedef struct instance_obj_s instance_obj;
 struct instance_obj_s {
     device_obj		*parent;
 
@@ -53,17 +149,376 @@ struct instance_obj_s {
     uint32_t		array_index;
     int			invoke_id;
 
+    /* While its device is polled with ReadPropertyMultiple, only the first of
+     * each RPM_MAX_INSTANCES instances is scheduled, and its request reads
+     * the rpm_count instances from it */
+    unsigned		rpm_count;
+    int			request;	/* In flight, REQUEST_* */
+
+    /* On a timer wheel slot, or its device's pending list */
+    list_entry		wheel;
+    unsigned long	due;		/* Tick */
+    struct timespec	sent;
+
     /* Retrieve data as integers (actually floats) and convert them to uint16_t
-     * for comparison with modbus data */
-    uint16_t		*needle;
-    uint16_t		*haystack;
+     * for comparison with modbus data. The received values are streamed
+     * through a Knuth-Morris-Pratt matcher rather than kept. The needle is
+     * the channel's data in the random data pool, which stays mapped */
+    const uint16_t	*needle;
+    uint32_t		*prefix;	/* After its device's by_no */
     size_t		num_words;
-    int			match;
+    size_t		matched;
+    unsigned long	samples;
+    unsigned long	matches;
     uint16_t		last_value;
 
+    /* Statistics */
+    unsigned long	duplicates;	/* Same value as the last */
+    unsigned long	timeouts;	/* TSM */
+    double		first_match_s;	/* 0 until it matches */
+    rtt_stats		rtt;
+
     list_entry		instances;
 };
 
+/* The instance whose requests read those being added to a device */
+static instance_obj *rpm_first;
+
+#define REQUEST_READ		    0
+#define REQUEST_RPM		    1
+#define REQUEST_SUBSCRIBE	    2
+
+/* Devices by device id. Only changed, under timer_lock, before the main loop
+ * starts */
+static device_obj *device_hash[DEVICE_HASH_SIZE];
+
+static device_obj *device_find(uint32_t device_id) {
+    device_obj *device = device_hash[device_id % DEVICE_HASH_SIZE];
+
+    while (device && device->device_id != device_id)
+	device = device->hash_next;
+    return device;
+}
+
+static unsigned long whois_now;	    /* Seconds */
+
+/* Look for the device again straight away, and bind it when it answers */
+static void device_lost(device_obj *device) {
+    device->found = 0;
+    device->whois_backoff = 1;
+    device->whois_due = whois_now;
+}
+
+static instance_obj *instance_find(device_obj *device, uint32_t instance_no) {
+    return instance_no < device->num_instances ?
+	    &device->by_no[instance_no] : NULL;
+}
+
+/* Outstanding requests by invoke id, so a reply is dispatched to its instance
+ * without searching. The instance's parent gives the device, so checking the
+ * reply's source is a single address comparison. libbacnet frees an invoke id
+ * as soon as its reply has been handled, so entries are released by the
+ * reply handlers before the id can be reused. Only accessed under
+ * timer_lock */
+#define MAX_INVOKE_IDS		    256
+
+static instance_obj *invoke_ids[MAX_INVOKE_IDS];
+
+static void invoke_id_set(instance_obj *instance, uint8_t invoke_id) {
+    instance->invoke_id = invoke_id;
+    if (invoke_id) invoke_ids[invoke_id] = instance;
+}
+
+static void invoke_id_release(instance_obj *instance) {
+    if (invoke_ids[instance->invoke_id] == instance)
+	invoke_ids[instance->invoke_id] = NULL;
+    instance->invoke_id = 0;
+}
+
+static struct timespec stats_start;
+
+static void stats_rtt_add(rtt_stats *rtt, double ms) {
+    rtt->count++;
+    rtt->sum_ms += ms;
+    if (ms > rtt->max_ms) rtt->max_ms = ms;
+    rtt->buckets[rtt_histogram_bucket(ms * 1000)]++;
+}
+
+static double stats_elapsed_s(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - stats_start.tv_sec +
+	    (now.tv_nsec - stats_start.tv_nsec) / 1e9;
+}
+
+/* Read_Property requests are scheduled on a timer wheel with a slot for each
+ * SCHED_TICK_MS tick, so each tick only visits the instances that are due. An
+ * instance is always on one list: a wheel slot while it waits to be read, or
+ * while its request is in flight (to check for a TSM timeout), or else its
+ * device's pending list, while the device has as many requests in flight as
+ * its window allows. Only accessed under timer_lock */
+#define SCHED_REPLY		    0
+#define SCHED_ERROR		    1	    /* Error or Reject */
+#define SCHED_FAILED		    2	    /* TSM timeout or Abort */
+
+static struct list_head sched_wheel[SCHED_WHEEL_SLOTS];
+static unsigned long sched_now;
+
+static void sched_init(void) {
+    int i;
+
+    for (i = 0; i < SCHED_WHEEL_SLOTS; i++) INIT_LIST_HEAD(&sched_wheel[i]);
+}
+
+static void sched_add(instance_obj *instance, unsigned ms) {
+    unsigned long ticks = (ms + SCHED_TICK_MS - 1) / SCHED_TICK_MS;
+
+    instance->due = sched_now + (ticks ? ticks : 1);
+    list_add_tail(&instance->wheel,
+		    &sched_wheel[instance->due % SCHED_WHEEL_SLOTS]);
+}
+
+/* Reading each instance this often has the device's window of requests in
+ * flight once per round trip */
+static unsigned sched_interval(device_obj *device) {
+    unsigned requests = device->num_instances;
+    double ms;
+
+    if (!device->srtt_ms) return SCHED_INTERVAL_MS;
+
+    if (device->rpm)
+	requests = (requests + RPM_MAX_INSTANCES - 1) / RPM_MAX_INSTANCES;
+    ms = requests * device->srtt_ms / device->window;
+    if (ms < SCHED_INTERVAL_MIN_MS) return SCHED_INTERVAL_MIN_MS;
+    if (ms > SCHED_INTERVAL_MAX_MS) return SCHED_INTERVAL_MAX_MS;
+    return ms;
+}
+
+/* Read the instance's Present_Value, along with those of the instances after
+ * it that share its ReadPropertyMultiple request */
+static uint8_t rpm_send(instance_obj *instance) {
+    static BACNET_READ_ACCESS_DATA objects[RPM_MAX_INSTANCES];
+    static BACNET_PROPERTY_REFERENCE properties[RPM_MAX_INSTANCES];
+    static uint8_t pdu[bacnet_MAX_MPDU];
+    uint32_t device_id = instance->parent->device_id;
+    unsigned i, count = instance->rpm_count;
+
+    for (i = 0; i < count; i++) {
+	properties[i].propertyIdentifier = instance->object_property;
+	properties[i].propertyArrayIndex = instance->array_index;
+	properties[i].next = NULL;
+
+	objects[i].object_type = instance->object_type;
+	objects[i].object_instance = instance->instance_no;
+	objects[i].listOfProperties = &properties[i];
+	objects[i].next = i + 1 < count ? &objects[i + 1] : NULL;
+
+	instance = list_next_entry(instance, instances);
+    }
+
+    return bacnet_Send_Read_Property_Multiple_Request(
+		    pdu, sizeof(pdu), device_id, objects);
+}
+
+/* Subscribe to, or renew a subscription to, the instance's changes of value */
+static uint8_t cov_subscribe(instance_obj *instance) {
+    BACNET_SUBSCRIBE_COV_DATA data;
+
+    memset(&data, 0, sizeof(data));
+    data.subscriberProcessIdentifier = COV_PROCESS_ID;
+    data.monitoredObjectIdentifier.type = instance->object_type;
+    data.monitoredObjectIdentifier.instance = instance->instance_no;
+    data.issueConfirmedNotifications = cov_mode == COV_CONFIRMED;
+    data.lifetime = COV_LIFETIME_S;
+
+    return bacnet_Send_COV_Subscribe(instance->parent->device_id, &data);
+}
+
+static void sched_send(instance_obj *instance) {
+    device_obj *device = instance->parent;
+
+    if (device->cov) {
+	instance->request = REQUEST_SUBSCRIBE;
+	invoke_id_set(instance, cov_subscribe(instance));
+    } else if (device->rpm && instance->rpm_count) {
+	instance->request = REQUEST_RPM;
+	invoke_id_set(instance, rpm_send(instance));
+    } else {
+	instance->request = REQUEST_READ;
+	invoke_id_set(instance,
+		bacnet_Send_Read_Property_Request(
+				    device->device_id,
+				    instance->object_type,
+				    instance->instance_no,
+				    instance->object_property,
+				    instance->array_index));
+    }
+
+    if (!instance->invoke_id) {
+	/* No free invoke id, or the address isn't bound. Try again later */
+	sched_add(instance, sched_interval(device));
+	return;
+    }
+
+    device->in_flight++;
+    clock_gettime(CLOCK_MONOTONIC, &instance->sent);
+    sched_add(instance, SCHED_TIMEOUT_CHECK_MS);
+}
+
+/* Send as many pending requests as the window now allows */
+static void sched_pending(device_obj *device) {
+    instance_obj *instance;
+
+    while (device->in_flight < device->window &&
+		    !list_empty(&device->pending)) {
+	instance = list_first_entry(&device->pending, instance_obj, wheel);
+	list_del(&instance->wheel);
+	sched_send(instance);
+    }
+}
+
+static void sched_backoff(device_obj *device) {
+    /* At most once per round trip, as a round trip's worth of replies all
+     * carry the same news */
+    if (sched_now < device->backoff_tick) return;
+
+    device->window /= 2;
+    if (device->window < 1) device->window = 1;
+    device->backoff_tick = sched_now + 1 + device->srtt_ms / SCHED_TICK_MS;
+}
+
+/* An instance's request has finished. The device's window grows by one
+ * request per round trip for as long as replies come back promptly, and
+ * halves on a TSM timeout or Abort, or when the smoothed round trip time
+ * rises to SCHED_RTT_SLACK times the lowest seen, as the server must then be
+ * queueing requests */
+static void sched_complete(instance_obj *instance, int result) {
+    device_obj *device = instance->parent;
+    struct timespec now;
+    double rtt_ms;
+
+    list_del(&instance->wheel);
+    device->in_flight--;
+
+    switch (result) {
+	case SCHED_REPLY:
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    rtt_ms = (now.tv_sec - instance->sent.tv_sec) * 1e3 +
+		    (now.tv_nsec - instance->sent.tv_nsec) / 1e6;
+	    stats_rtt_add(&instance->rtt, rtt_ms);
+	    stats_rtt_add(&device->rtt, rtt_ms);
+
+	    if (!device->srtt_ms)
+		device->srtt_ms = device->min_rtt_ms = rtt_ms;
+	    device->srtt_ms += (rtt_ms - device->srtt_ms) / 8;
+
+	    /* Let the minimum follow a route that has become slower */
+	    if (rtt_ms < device->min_rtt_ms) device->min_rtt_ms = rtt_ms;
+	    else device->min_rtt_ms += (rtt_ms - device->min_rtt_ms) / 1024;
+
+	    if (device->srtt_ms > SCHED_RTT_SLACK * device->min_rtt_ms +
+			    SCHED_RTT_SLACK_MS)
+		sched_backoff(device);
+	    else if ((device->window += 1 / device->window) > SCHED_WINDOW_MAX)
+		device->window = SCHED_WINDOW_MAX;
+	    break;
+
+	case SCHED_FAILED:
+	    device->failures++;
+	    sched_backoff(device);
+	    break;
+    }
+
+    if (result == SCHED_REPLY && instance->request == REQUEST_SUBSCRIBE &&
+		    device->cov)
+	sched_add(instance, COV_RENEW_MS);
+    else
+	sched_add(instance, sched_interval(device));
+    sched_pending(device);
+}
+
+/* The instance's tick has come: either it's time to read it, or to check
+ * whether its request has timed out */
+static void sched_due(instance_obj *instance) {
+    device_obj *device = instance->parent;
+
+    if (instance->invoke_id) {
+	if (bacnet_tsm_invoke_id_failed(instance->invoke_id)) {
+	    fprintf(stderr, "Error: TSM Timeout for device %i\n",
+			    device->device_id);
+
+	    bacnet_tsm_free_invoke_id(instance->invoke_id);
+	    invoke_id_release(instance);
+	    instance->timeouts++;
+	    device_lost(device);
+	    sched_complete(instance, SCHED_FAILED);
+
+	} else if (bacnet_tsm_invoke_id_free(instance->invoke_id)) {
+	    /* Transaction finished without a reply reaching a handler */
+	    invoke_id_release(instance);
+	    sched_complete(instance, SCHED_ERROR);
+
+	} else {
+	    list_del(&instance->wheel);
+	    sched_add(instance, SCHED_TIMEOUT_CHECK_MS);
+	}
+	return;
+    }
+
+    list_del(&instance->wheel);
+    if (!device->found)
+	sched_add(instance, sched_interval(device));
+    else if (device->in_flight < device->window)
+	sched_send(instance);
+    else
+	list_add_tail(&instance->wheel, &device->pending);
+}
+
+/* The device has rejected ReadPropertyMultiple, so from now on read each of
+ * its instances with ReadProperty */
+static void rpm_fallback(device_obj *device) {
+    instance_obj *instance;
+
+    if (!device->rpm) return;
+
+    fprintf(stderr, "Device %i: reading instances singly\n",
+		    device->device_id);
+    device->rpm = 0;
+    list_for_each_entry(instance, &device->instances, instances)
+	if (!instance->rpm_count) sched_add(instance, 0);
+}
+
+/* The device has rejected SubscribeCOV, so poll its instances instead */
+static void cov_fallback(device_obj *device) {
+    instance_obj *instance;
+
+    if (!device->cov) return;
+
+    fprintf(stderr, "Device %i: polling instances\n", device->device_id);
+    device->cov = 0;
+
+    /* Rather than when their subscriptions would have been renewed */
+    list_for_each_entry(instance, &device->instances, instances) {
+	if (instance->invoke_id) continue;
+	list_del(&instance->wheel);
+	sched_add(instance, 0);
+    }
+}
+
+static void sched_report(void) {
+    device_obj *device;
+
+    list_for_each_entry(device, &devices, devices) {
+	fprintf(stderr, "Device %i: window %.1f, round trip %.2f ms, "
+			"interval %u ms, %lu failures, %lu notifications\n",
+			device->device_id, device->window, device->srtt_ms,
+			sched_interval(device), device->failures,
+			device->notifications);
+	device->failures = device->notifications = 0;
+    }
+}
+
 static bacnet_object_functions_t client_objects[] = {
     {bacnet_OBJECT_DEVICE,
 	    NULL,
@@ -90,9 +545,361 @@ static void register_with_bbmd(void) {
 	    bacnet_bip_getaddrbyname(BACNET_BBMD_ADDRESS), 
 	    htons(BACNET_BBMD_PORT),
 	    BACNET_BBMD_TTL);
+#else
+    BACNET_ADDRESS my_address;
+    uint32_t address;	    /* Network byte order, as in the MAC */
+
+    /* The first shard forwards broadcasts, such as I-Am, to the others */
+    if (!shard) return;
+
+    bacnet_datalink_get_my_address(&my_address);
+    memcpy(&address, &my_address.mac[0], 4);
+    bacnet_bvlc_register_with_bbmd(address, htons(BACNET_PORT),
+		    SHARD_BBMD_TTL);
 #endif
 }
 
+/* libbacnet keeps its transaction state machine, address cache and socket in
+ * globals, so shards are processes rather than threads. Each owns the devices
+ * whose ids are its shard number modulo the number of shards, with their
+ * matchers and scheduling, and has its own socket. Returns in each shard */
+static void fork_shards(void) {
+    unsigned i;
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 1; i < shards; i++) {
+	if ((pid = fork()) < 0) {
+	    fprintf(stderr, "Error forking shard: %s\n", strerror(errno));
+	    exit(1);
+	}
+	if (!pid) {
+	    /* Shards don't outlive the first */
+	    prctl(PR_SET_PDEATHSIG, SIGTERM);
+	    shard = i;
+	    return;
+	}
+    }
+}
+
+/* Batched BACnet/IP datalink, see dgram_batch.h. A batch is open while
+ * handling received datagrams and while read_prop_thread issues a round of
+ * requests. The link is only touched under timer_lock */
+static unsigned batch_size = BACNET_BATCH_SIZE;
+
+static void batch_init(void) {
+    BACNET_ADDRESS my_address;
+
+    /* Route all sends through the link so they are counted */
+    bacnet_datalink_get_my_address(&my_address);
+    dgram_link_init(bacnet_bip_socket(), batch_size, bacnet_MAX_MPDU,
+		    BATCH_RECEIVE, &my_address, bacnet_datalink_send_pdu);
+    bacnet_datalink_send_pdu = dgram_link_send_pdu;
+}
+
+/* Statistics are written to stats_path every STATS_PERIOD_S seconds and when
+ * bacnet_client exits, as JSON, or as CSV with one row per instance if the
+ * name ends in .csv. Each shard after the first appends its number. Files are
+ * replaced whole, so a reader never sees one half written */
+static char *stats_path;
+static volatile sig_atomic_t running = 1;
+
+/* A round trip summary, as reported */
+typedef struct rtt_summary_s rtt_summary;
+struct rtt_summary_s {
+    unsigned long	count;
+    double		mean_ms;
+    double		p50_ms;
+    double		p90_ms;
+    double		p99_ms;
+    double		p999_ms;
+    double		max_ms;
+};
+
+/* A snapshot of the statistics. stats_take() copies them under timer_lock
+ * and stats_write() formats and writes the copy once the lock is released,
+ * so that polling carries on while the file is written. stats_lock keeps a
+ * snapshot from being replaced while it's written, and is taken before
+ * timer_lock */
+typedef struct device_stats_s device_stats;
+struct device_stats_s {
+    uint32_t		device_id;
+    int			found;
+    unsigned long	rebinds;
+    double		window;
+    unsigned		num_instances;	/* Following its last device's */
+    rtt_summary		rtt;
+};
+
+typedef struct instance_stats_s instance_stats;
+struct instance_stats_s {
+    int			instance_no;
+    unsigned long	samples;
+    unsigned long	duplicates;
+    unsigned long	timeouts;
+    unsigned long	matches;
+    double		first_match_s;
+    rtt_summary		rtt;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static device_stats *stats_devices;
+static instance_stats *stats_instances;
+static unsigned stats_num_devices, stats_devices_size;
+static unsigned stats_num_instances, stats_instances_size;
+static double stats_elapsed;
+static rtt_summary stats_total;		/* Of every device */
+
+/* The upper bound of the bucket holding the fraction p of round trips, or the
+ * longest round trip if that's less */
+static double stats_percentile_ms(rtt_stats *rtt, double p) {
+    unsigned long seen = 0;
+    double ms;
+    unsigned i;
+
+    if (!rtt->count) return 0;
+    for (i = 0; i < RTT_HISTOGRAM_BUCKETS; i++) {
+	seen += rtt->buckets[i];
+	if (seen >= p * rtt->count) break;
+    }
+    ms = rtt_histogram_bucket_us(i + 1) / 1000.0;
+    return ms < rtt->max_ms ? ms : rtt->max_ms;
+}
+
+static void stats_rtt_merge(rtt_stats *total, rtt_stats *rtt) {
+    unsigned i;
+
+    total->count += rtt->count;
+    total->sum_ms += rtt->sum_ms;
+    if (rtt->max_ms > total->max_ms) total->max_ms = rtt->max_ms;
+    for (i = 0; i < RTT_HISTOGRAM_BUCKETS; i++)
+	total->buckets[i] += rtt->buckets[i];
+}
+
+static void stats_rtt_summarise(rtt_summary *summary, rtt_stats *rtt) {
+    summary->count = rtt->count;
+    summary->mean_ms = rtt->count ? rtt->sum_ms / rtt->count : 0;
+    summary->p50_ms = stats_percentile_ms(rtt, 0.5);
+    summary->p90_ms = stats_percentile_ms(rtt, 0.9);
+    summary->p99_ms = stats_percentile_ms(rtt, 0.99);
+    summary->p999_ms = stats_percentile_ms(rtt, 0.999);
+    summary->max_ms = rtt->max_ms;
+}
+
+/* Copy the statistics to the snapshot. Called with stats_lock and timer_lock
+ * held */
+static void stats_take(void) {
+    static rtt_stats total;
+    unsigned num_devices = 0, num_instances = 0;
+    device_obj *device;
+    instance_obj *instance;
+    device_stats *d;
+    instance_stats *s;
+
+    /* Devices are still being added while the first are polled */
+    list_for_each_entry(device, &devices, devices) {
+	num_devices++;
+	num_instances += device->num_instances;
+    }
+    if (num_devices > stats_devices_size) {
+	if (!(d = realloc(stats_devices, num_devices * sizeof(*d)))) {
+	    fprintf(stderr, "Error allocating statistics\n");
+	    exit(1);
+	}
+	stats_devices = d;
+	stats_devices_size = num_devices;
+    }
+    if (num_instances > stats_instances_size) {
+	if (!(s = realloc(stats_instances, num_instances * sizeof(*s)))) {
+	    fprintf(stderr, "Error allocating statistics\n");
+	    exit(1);
+	}
+	stats_instances = s;
+	stats_instances_size = num_instances;
+    }
+
+    stats_elapsed = stats_elapsed_s();
+    memset(&total, 0, sizeof(total));
+    d = stats_devices;
+    s = stats_instances;
+
+    list_for_each_entry(device, &devices, devices) {
+	d->device_id = device->device_id;
+	d->found = device->found;
+	d->rebinds = device->binds ? device->binds - 1 : 0;
+	d->window = device->window;
+	d->num_instances = 0;
+	stats_rtt_summarise(&d->rtt, &device->rtt);
+	stats_rtt_merge(&total, &device->rtt);
+
+	list_for_each_entry(instance, &device->instances, instances) {
+	    s->instance_no = instance->instance_no;
+	    s->samples = instance->samples;
+	    s->duplicates = instance->duplicates;
+	    s->timeouts = instance->timeouts;
+	    s->matches = instance->matches;
+	    s->first_match_s = instance->first_match_s;
+	    stats_rtt_summarise(&s->rtt, &instance->rtt);
+	    d->num_instances++;
+	    s++;
+	}
+	d++;
+    }
+
+    stats_num_devices = num_devices;
+    stats_num_instances = s - stats_instances;
+    stats_rtt_summarise(&stats_total, &total);
+}
+
+static void stats_rtt_json(FILE *f, const rtt_summary *rtt) {
+    fprintf(f, "{\"count\": %lu, \"mean_ms\": %.3f, \"p50_ms\": %.3f, "
+		    "\"p90_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, "
+		    "\"max_ms\": %.3f}",
+		    rtt->count, rtt->mean_ms, rtt->p50_ms, rtt->p90_ms,
+		    rtt->p99_ms, rtt->p999_ms, rtt->max_ms);
+}
+
+static void stats_write_json(FILE *f, int final) {
+    const device_stats *device;
+    const instance_stats *instance = stats_instances;
+    const char *device_sep = "", *sep;
+    unsigned i, j;
+
+    fprintf(f, "{\"shard\": %u, \"elapsed_s\": %.3f, \"final\": %s, "
+		    "\"devices\": [", shard, stats_elapsed,
+		    final ? "true" : "false");
+
+    for (i = 0; i < stats_num_devices; i++) {
+	device = &stats_devices[i];
+	fprintf(f, "%s\n {\"device\": %u, \"found\": %s, \"rebinds\": %lu, "
+			"\"window\": %.1f, \"rtt\": ", device_sep,
+			device->device_id, device->found ? "true" : "false",
+			device->rebinds, device->window);
+	stats_rtt_json(f, &device->rtt);
+	fprintf(f, ", \"instances\": [");
+	sep = "";
+
+	for (j = 0; j < device->num_instances; j++, instance++) {
+	    fprintf(f, "%s\n  {\"instance\": %i, \"samples\": %lu, "
+			    "\"samples_per_s\": %.3f, \"duplicates\": %lu, "
+			    "\"timeouts\": %lu, \"matches\": %lu, "
+			    "\"first_match_s\": ", sep,
+			    instance->instance_no, instance->samples,
+			    instance->samples / stats_elapsed,
+			    instance->duplicates, instance->timeouts,
+			    instance->matches);
+	    if (instance->matches)
+		fprintf(f, "%.3f", instance->first_match_s);
+	    else
+		fprintf(f, "null");
+	    fprintf(f, ", \"rtt\": ");
+	    stats_rtt_json(f, &instance->rtt);
+	    fprintf(f, "}");
+	    sep = ",";
+	}
+	fprintf(f, "]}");
+	device_sep = ",";
+    }
+    fprintf(f, "]}\n");
+}
+
+static void stats_write_csv(FILE *f) {
+    const device_stats *device;
+    const instance_stats *instance = stats_instances;
+    const rtt_summary *rtt;
+    unsigned i, j;
+
+    fprintf(f, "device,instance,samples,samples_per_s,duplicates,timeouts,"
+		    "rebinds,matches,first_match_s,rtt_count,rtt_mean_ms,"
+		    "rtt_p50_ms,rtt_p90_ms,rtt_p99_ms,rtt_p999_ms,rtt_max_ms\n");
+
+    for (i = 0; i < stats_num_devices; i++) {
+	device = &stats_devices[i];
+	for (j = 0; j < device->num_instances; j++, instance++) {
+	    rtt = &instance->rtt;
+	    fprintf(f, "%u,%i,%lu,%.3f,%lu,%lu,%lu,%lu,",
+			    device->device_id, instance->instance_no,
+			    instance->samples,
+			    instance->samples / stats_elapsed,
+			    instance->duplicates, instance->timeouts,
+			    device->rebinds, instance->matches);
+	    if (instance->matches)
+		fprintf(f, "%.3f", instance->first_match_s);
+	    fprintf(f, ",%lu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", rtt->count,
+			    rtt->mean_ms, rtt->p50_ms, rtt->p90_ms,
+			    rtt->p99_ms, rtt->p999_ms, rtt->max_ms);
+	}
+    }
+}
+
+/* A summary of the run for stdout */
+static void stats_summary(void) {
+    unsigned found = 0, matched = 0;
+    unsigned long samples = 0, duplicates = 0, timeouts = 0, rebinds = 0;
+    const instance_stats *instance;
+    unsigned i;
+
+    for (i = 0; i < stats_num_devices; i++) {
+	found += stats_devices[i].found;
+	rebinds += stats_devices[i].rebinds;
+    }
+
+    for (i = 0; i < stats_num_instances; i++) {
+	instance = &stats_instances[i];
+	matched += instance->matches != 0;
+	samples += instance->samples;
+	duplicates += instance->duplicates;
+	timeouts += instance->timeouts;
+    }
+
+    printf("Shard %u after %.1f s: %u of %u devices found, "
+		    "%u of %u instances matched, %.1f samples/s, "
+		    "%lu duplicates, %lu TSM timeouts, %lu rebinds, "
+		    "round trip p50 %.3f ms p99 %.3f ms max %.3f ms\n",
+		    shard, stats_elapsed, found, stats_num_devices, matched,
+		    stats_num_instances, samples / stats_elapsed, duplicates,
+		    timeouts, rebinds, stats_total.p50_ms, stats_total.p99_ms,
+		    stats_total.max_ms);
+}
+
+/* Write the snapshot. Called with stats_lock held */
+static void stats_write(int final) {
+    char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+    size_t len;
+    FILE *f;
+
+    if (final) stats_summary();
+    if (!stats_path) return;
+
+    len = strlen(stats_path);
+    if (!shard)
+	snprintf(path, sizeof(path), "%s", stats_path);
+    else if (len > 4 && !strcmp(stats_path + len - 4, ".csv"))
+	snprintf(path, sizeof(path), "%.*s.%u.csv",
+			(int) len - 4, stats_path, shard);
+    else
+	snprintf(path, sizeof(path), "%s.%u", stats_path, shard);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    if (!(f = fopen(tmp_path, "w"))) {
+	fprintf(stderr, "Unable to write %s: %s\n", tmp_path, strerror(errno));
+	return;
+    }
+
+    if (len > 4 && !strcmp(stats_path + len - 4, ".csv"))
+	stats_write_csv(f);
+    else
+	stats_write_json(f, final);
+
+    if (fclose(f) || rename(tmp_path, path))
+	fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+}
+
+static void stop(int signum) {
+    running = 0;
+}
+
 static void *minute_tick(void *arg) {
     while (1) {
 	pthread_mutex_lock(&timer_lock);
@@ -107,6 +914,10 @@ static void *minute_tick(void *arg) {
 	 * Requred for INTRINSIC_REPORTING
 	 * bacnet_Notification_Class_find_recipient(); */
 
+	/* Report BACnet/IP packet rates */
+	dgram_link_report(60);
+	sched_report();
+
 	/* Sleep for 1 minute */
 	pthread_mutex_unlock(&timer_lock);
 	sleep(60);
@@ -114,18 +925,59 @@ static void *minute_tick(void *arg) {
     return arg;
 }
 
+static int device_id_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Look for devices that haven't been found with as few Who-Is as possible.
+ * Each is asked for again after twice as long as the time before, up to
+ * WHOIS_BACKOFF_MAX_S, and those due at once that have device ids no more
+ * than WHOIS_RANGE_GAP apart share a ranged Who-Is */
 static void ping_servers(void) {
+    static uint32_t *ids;
+    static unsigned ids_size;
     device_obj *device;
+    unsigned i, j, n = 0;
+
+    whois_now++;
     list_for_each_entry(device, &devices, devices) {
-	if (!device->found)
-	    bacnet_Send_WhoIs(device->device_id, device->device_id);
+	if (device->found || device->whois_due > whois_now) continue;
+
+	if (n == ids_size) {
+	    ids_size = ids_size ? ids_size * 2 : 64;
+	    if (!(ids = realloc(ids, ids_size * sizeof(uint32_t)))) {
+		fprintf(stderr, "Error allocating device ids\n");
+		exit(1);
+	    }
+	}
+	ids[n++] = device->device_id;
+
+	device->whois_due = whois_now + device->whois_backoff;
+	device->whois_backoff *= 2;
+	if (device->whois_backoff > WHOIS_BACKOFF_MAX_S)
+	    device->whois_backoff = WHOIS_BACKOFF_MAX_S;
+    }
+
+    qsort(ids, n, sizeof(uint32_t), device_id_compare);
+    for (i = 0; i < n; i = j) {
+	for (j = i + 1; j < n && ids[j] - ids[j - 1] <= WHOIS_RANGE_GAP; j++);
+	bacnet_Send_WhoIs(ids[i], ids[j - 1]);
     }
 }
 
 static void *second_tick(void *arg) {
+    unsigned seconds = 0;
+    int write_stats;
+
     while (1) {
+	write_stats = ++seconds % STATS_PERIOD_S == 0 && stats_path;
+	if (write_stats) pthread_mutex_lock(&stats_lock);
 	pthread_mutex_lock(&timer_lock);
 
+	if (write_stats) stats_take();
+
 	/* Keep searching for server */
 	ping_servers();
 
@@ -156,35 +1008,40 @@ static void *second_tick(void *arg) {
 	 * Required for INTRINSIC_REPORTING
 	 * bacnet_Device_local_reporting(); */
 
-	/* Sleep for 1 second */
 	pthread_mutex_unlock(&timer_lock);
+	if (write_stats) {
+	    stats_write(0);
+	    pthread_mutex_unlock(&stats_lock);
+	}
+
+	/* Sleep for 1 second */
 	sleep(1);
     }
     return arg;
 }
 
-static void ack_servers(void) {
-    device_obj *device;
+/* Bind a device as soon as it announces itself */
+static void i_am(
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src) {
+    uint32_t device_id;
     unsigned max_apdu;
+    int segmentation;
+    uint16_t vendor_id;
+    device_obj *device;
 
-    list_for_each_entry(device, &devices, devices) {
-
-	if (!device->found)
-	    device->found =
-		bacnet_address_bind_request(
-		    device->device_id,
-		    &max_apdu,
-		    &device->bacnet_address);
-    }
-
-}
+    if (bacnet_iam_decode_service_request(service_request, &device_id,
+			    &max_apdu, &segmentation, &vendor_id) < 0 ||
+		    !(device = device_find(device_id)))
+	return;
 
-static void ms_tick(void) {
-    /* Updates change of value COV subscribers.
-     * Required for SERVICE_CONFIRMED_SUBSCRIBE_COV
-     * bacnet_handler_cov_task(); */
+    /* For libbacnet's requests to it */
+    bacnet_address_add(device_id, max_apdu, src);
 
-    ack_servers();
+    device->bacnet_address = *src;
+    if (!device->found) device->binds++;
+    device->found = 1;
 }
 
 #define BN_UNC(service, handler) \
@@ -204,23 +1061,19 @@ static void ms_tick(void) {
 		    SERVICE_CONFIRMED_##service,	\
 		    handler)
 
+/* Find the instance that a reply is for, and release its invoke id */
 static device_obj *match_server(BACNET_ADDRESS *src,
 			uint8_t invoke_id,
 			instance_obj **instance_out) {
-    device_obj *device;
-    instance_obj *instance;
-    list_for_each_entry(device, &devices, devices) {
-	if (bacnet_address_match(&device->bacnet_address, src)) {
-	    list_for_each_entry(instance, &device->instances, instances) {
-		if (instance->invoke_id == invoke_id) {
-		    if (instance_out)
-			*instance_out = instance;
-		    return device;
-		}
-	    }
-	}
-    }
-    return NULL;
+    instance_obj *instance = invoke_ids[invoke_id];
+
+    if (!instance ||
+	    !bacnet_address_match(&instance->parent->bacnet_address, src))
+	return NULL;
+
+    invoke_id_release(instance);
+    if (instance_out) *instance_out = instance;
+    return instance->parent;
 }
 
 static void abort_handler(
@@ -230,13 +1083,15 @@ static void abort_handler(
 		bool server) {
 
     device_obj *device;
+    instance_obj *instance;
     
-    if (!(device = match_server(src, invoke_id, NULL))) return;
+    if (!(device = match_server(src, invoke_id, &instance))) return;
 
     fprintf(stderr, "BACnet Abort from server %i: %s\n",
 	    device->device_id,
 	    bactext_abort_reason_name(abort_reason));
-    device->found = 0;
+    device_lost(device);
+    sched_complete(instance, SCHED_FAILED);
 }
 
 static void reject_handler(
@@ -245,13 +1100,17 @@ static void reject_handler(
 		uint8_t reject_reason) {
 
     device_obj *device;
+    instance_obj *instance;
     
-    if (!(device = match_server(src, invoke_id, NULL))) return;
+    if (!(device = match_server(src, invoke_id, &instance))) return;
 
     fprintf(stderr, "BACnet Reject from server %i: %s\n",
 	    device->device_id,
 	    bactext_reject_reason_name(reject_reason));
-    device->found = 0;
+    if (instance->request == REQUEST_RPM) rpm_fallback(device);
+    else if (instance->request == REQUEST_SUBSCRIBE) cov_fallback(device);
+    else device_lost(device);
+    sched_complete(instance, SCHED_ERROR);
 }
 
 static void read_property_err(
@@ -261,53 +1120,158 @@ static void read_property_err(
 		BACNET_ERROR_CODE error_code) {
 
     device_obj *device;
+    instance_obj *instance;
     
-    if (!(device = match_server(src, invoke_id, NULL))) return;
+    if (!(device = match_server(src, invoke_id, &instance))) return;
 
     fprintf(stderr, "BACnet Error from server %i: %s: %s\n",
 	    device->device_id,
 	    bactext_error_class_name(error_class),
 	    bactext_error_code_name(error_code));
-    device->found = 0;
+    if (instance->request == REQUEST_RPM) rpm_fallback(device);
+    else if (instance->request == REQUEST_SUBSCRIBE) cov_fallback(device);
+    else device_lost(device);
+    sched_complete(instance, SCHED_ERROR);
 }
 
-static void array_tail(uint16_t data, instance_obj *instance) {
-    int i;
+/* prefix[i] is the length of the longest proper prefix of needle[0..i] that
+ * is also a suffix of it */
+static void match_init(const uint16_t *needle, uint32_t *prefix,
+			size_t num_words) {
+    size_t i, k = 0;
+
+    prefix[0] = 0;
+    for (i = 1; i < num_words; i++) {
+	while (k && needle[i] != needle[k]) k = prefix[k - 1];
+	if (needle[i] == needle[k]) k++;
+	prefix[i] = k;
+    }
+}
 
-    /* If we are making requests too often, it is possible to get ahead of the
-     * bacnet_server. If so, just drop the data */
-    if (data == instance->last_value) return;
-    instance->last_value = data;
+/* Feed the next sample to the matcher. *matched is the number of words of the
+ * needle that the latest samples match. Returns 1 when they match all of it.
+ * Amortised O(1) per sample, however long the needle */
+static int match_next(const uint16_t *needle, const uint32_t *prefix,
+			size_t num_words, size_t *matched, uint16_t data) {
+    size_t k = *matched;
+
+    while (k && needle[k] != data) k = prefix[k - 1];
+    if (needle[k] == data) k++;
 
-    /* Shift the array */
-    for (i = 0; i < instance->num_words - 1; i++) {
-	instance->haystack[i] = instance->haystack[i+1];
+    if (k == num_words) {
+	/* Carry on, in case the needle overlaps itself */
+	*matched = prefix[k - 1];
+	return 1;
     }
 
-    /* Place new data in the last entry of the array */
-    instance->haystack[instance->num_words - 1] = data;
+    *matched = k;
+    return 0;
+}
 
+static void array_tail(uint16_t data, instance_obj *instance) {
 #if debug
-    for (i = 0; i < instance->num_words; i++) {
-	printf("%04X ", instance->haystack[i]);
-	if ((i % 8) == 7) printf("\n");
+    size_t i;
+#endif
+
+    /* If we are making requests too often, it is possible to get ahead of the
+     * bacnet_server. If so, just drop the data */
+    if (data == instance->last_value) {
+	instance->duplicates++;
+	return;
+    }
+    instance->last_value = data;
+    instance->samples++;
+
+    if (match_next(instance->needle, instance->prefix, instance->num_words,
+			    &instance->matched, data)) {
+	if (!instance->matches++) instance->first_match_s = stats_elapsed_s();
+	printf("Successful match for device %i, instance %i at sample %lu\n",
+			instance->parent->device_id, instance->instance_no,
+			instance->samples - instance->num_words);
     }
-    printf("\n");
 
+#if debug
+    printf("%04X: %zu of %zu words matched\n", data,
+		    instance->matched, instance->num_words);
     for (i = 0; i < instance->num_words; i++) {
 	printf("%04X ", instance->needle[i]);
 	if ((i % 8) == 7) printf("\n");
     }
     printf("\n");
 #endif
+}
+
+static double bench_ns(const struct timespec *start) {
+    struct timespec now;
 
-    if (!memcmp(instance->needle, 
-		instance->haystack,
-		instance->num_words * sizeof(uint16_t))) {
-	instance->match = 1;
-	printf("Successful match for device %i, instance %i\n",
-			instance->parent->device_id, instance->instance_no);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + now.tv_nsec - start->tv_nsec;
+}
+
+/* Compare the streaming matcher with shifting and comparing the whole needle
+ * for every sample, as array_tail() used to. The samples are random, with the
+ * needle planted in them every few needle lengths */
+static void match_benchmark(size_t num_words) {
+    unsigned long i, j, shift_samples, matches = 0, shift_matches = 0;
+    uint16_t *needle, *haystack, *stream;
+    uint32_t *prefix;
+    size_t matched = 0;
+    struct timespec start;
+    double match_ns, shift_ns;
+
+    needle = malloc(num_words * sizeof(uint16_t));
+    haystack = calloc(num_words, sizeof(uint16_t));
+    prefix = malloc(num_words * sizeof(uint32_t));
+    stream = malloc(BENCH_SAMPLES * sizeof(uint16_t));
+    if (!needle || !haystack || !prefix || !stream) {
+	fprintf(stderr, "Error allocating benchmark data\n");
+	exit(1);
     }
+
+    srandom(1);
+    for (i = 0; i < num_words; i++)
+	needle[i] = 1 + random() % BENCH_ALPHABET;
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+	if (i % (num_words * 4) == 0 && BENCH_SAMPLES - i >= num_words) {
+	    memcpy(&stream[i], needle, num_words * sizeof(uint16_t));
+	    i += num_words - 1;
+	} else stream[i] = 1 + random() % BENCH_ALPHABET;
+    }
+
+    shift_samples = BENCH_SHIFT_WORDS / num_words;
+    if (shift_samples > BENCH_SAMPLES) shift_samples = BENCH_SAMPLES;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    match_init(needle, prefix, num_words);
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+	if (match_next(needle, prefix, num_words, &matched, stream[i]) &&
+			i < shift_samples)
+	    matches++;
+    }
+    match_ns = bench_ns(&start) / BENCH_SAMPLES;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < shift_samples; i++) {
+	for (j = 0; j < num_words - 1; j++) haystack[j] = haystack[j + 1];
+	haystack[num_words - 1] = stream[i];
+	if (!memcmp(needle, haystack, num_words * sizeof(uint16_t)))
+	    shift_matches++;
+    }
+    shift_ns = bench_ns(&start) / shift_samples;
+
+    printf("%zu word needle: streaming %.1f ns/sample, "
+		    "shift and compare %.1f ns/sample, %lu matches\n",
+		    num_words, match_ns, shift_ns, matches);
+    if (matches != shift_matches) {
+	fprintf(stderr, "Error: matchers disagree, %lu and %lu matches\n",
+			matches, shift_matches);
+	exit(1);
+    }
+
+    free(needle);
+    free(haystack);
+    free(prefix);
+    free(stream);
 }
 
 static void read_property_ack(
@@ -342,48 +1306,155 @@ static void read_property_ack(
 	    device->device_id, instance->instance_no);
 #endif
     }
+
+    sched_complete(instance, SCHED_REPLY);
 }
 
-static void send_rp_request(device_obj *device, instance_obj *instance) {
-    if (!device->found) return;
+/* libbacnet allocates all but the first object of a decoded reply */
+static void rpm_free(BACNET_READ_ACCESS_DATA *data) {
+    BACNET_READ_ACCESS_DATA *object, *next_object;
+    BACNET_PROPERTY_REFERENCE *property, *next_property;
+    BACNET_APPLICATION_DATA_VALUE *value, *next_value;
+
+    for (object = data; object; object = next_object) {
+	for (property = object->listOfProperties; property;
+			property = next_property) {
+	    for (value = property->value; value; value = next_value) {
+		next_value = value->next;
+		free(value);
+	    }
+	    next_property = property->next;
+	    free(property);
+	}
+	next_object = object->next;
+	if (object != data) free(object);
+    }
+}
 
-    if (!instance->invoke_id)
-	instance->invoke_id = 
-		bacnet_Send_Read_Property_Request(
-				    device->device_id,
-				    instance->object_type,
-				    instance->instance_no,
-				    instance->object_property,
-				    instance->array_index);
+static void read_property_multiple_ack(
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src,
+		BACNET_CONFIRMED_SERVICE_ACK_DATA *service_data) {
+    BACNET_READ_ACCESS_DATA data, *object;
+    BACNET_APPLICATION_DATA_VALUE *value;
+    instance_obj *first, *instance;
+    unsigned i = 0, n;
+
+    if (!match_server(src, service_data->invoke_id, &first)) return;
+
+    memset(&data, 0, sizeof(data));
+    if (bacnet_rpm_ack_decode_service_request(
+			service_request, service_len, &data) < 0) {
+	/* A malformed reply counts as an error, not a round trip */
+	fprintf(stderr,
+		"Read Property Multiple ACK service request decode failed\n");
+	rpm_free(&data);
+	sched_complete(first, SCHED_ERROR);
+	return;
+    }
 
-    else if (bacnet_tsm_invoke_id_free(instance->invoke_id))
+    /* The values come in the order they were requested, so walk along the
+     * instances after the first as they do */
+    instance = first;
+    for (object = &data; object; object = object->next) {
+	n = object->object_instance - first->instance_no;
+	if (object->object_type != first->object_type ||
+			n >= first->rpm_count || !object->listOfProperties)
+	    continue;
+
+	if (n < i) {
+	    instance = first;
+	    i = 0;
+	}
+	for (; i < n; i++) instance = list_next_entry(instance, instances);
 
-	/* Transaction is finished */
-	instance->invoke_id = 0;
+	/* Errors for single properties come without a value */
+	value = object->listOfProperties->value;
+	if (value && value->tag == BACNET_APPLICATION_TAG_REAL)
+	    array_tail(value->type.Real, instance);
+    }
 
-    else if (bacnet_tsm_invoke_id_failed(instance->invoke_id)) {
+    rpm_free(&data);
+    sched_complete(first, SCHED_REPLY);
+}
 
-	fprintf(stderr, "Error: TSM Timeout for device %i\n",
-			device->device_id);
+static void subscribe_cov_ack(BACNET_ADDRESS *src, uint8_t invoke_id) {
+    instance_obj *instance;
 
-	bacnet_tsm_free_invoke_id(instance->invoke_id);
-	instance->invoke_id = 0;
-	device->found = 0;
-    }
+    if (!match_server(src, invoke_id, &instance)) return;
+    sched_complete(instance, SCHED_REPLY);
 }
 
-static void *read_prop_thread(void *arg) {
+/* Changes of value are matched just like values that have been read */
+static void cov_notification(
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src) {
+    BACNET_PROPERTY_VALUE values[COV_MAX_VALUES], *value;
+    BACNET_COV_DATA data;
     device_obj *device;
     instance_obj *instance;
-    while (1) {
+    int i;
+
+    memset(values, 0, sizeof(values));
+    for (i = 0; i < COV_MAX_VALUES - 1; i++) values[i].next = &values[i + 1];
+    data.listOfValues = values;
+
+    if (bacnet_cov_notify_decode_service_request(
+			service_request, service_len, &data) < 0) {
+	fprintf(stderr, "COV Notification decode failed\n");
+	return;
+    }
+
+    if (!(device = device_find(data.initiatingDeviceIdentifier)) ||
+		    !(instance = instance_find(device,
+			    data.monitoredObjectIdentifier.instance)) ||
+		    data.monitoredObjectIdentifier.type != instance->object_type)
+	return;
+
+    device->notifications++;
+    for (value = data.listOfValues; value; value = value->next) {
+	if (value->propertyIdentifier == instance->object_property &&
+			value->value.tag == BACNET_APPLICATION_TAG_REAL)
+	    array_tail(value->value.type.Real, instance);
+    }
+}
+
+static void ccov_notification(
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src,
+		BACNET_CONFIRMED_SERVICE_DATA *service_data) {
+    cov_notification(service_request, service_len, src);
 
-	usleep(100000);
+    /* Sends the SimpleACK */
+    bacnet_handler_ccov_notification(
+		    service_request, service_len, src, service_data);
+}
+
+static void *read_prop_thread(void *arg) {
+    instance_obj *instance, *next;
+    struct list_head *slot;
+    struct timespec tick;
+
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    while (1) {
+	/* Ticks missed while the lock was held are caught up at once */
+	tick.tv_nsec += SCHED_TICK_MS * 1000000L;
+	if (tick.tv_nsec >= 1000000000L) {
+	    tick.tv_sec++;
+	    tick.tv_nsec -= 1000000000L;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
 
 	pthread_mutex_lock(&timer_lock);
 
-	list_for_each_entry(device, &devices, devices)
-	    list_for_each_entry(instance, &device->instances, instances)
-		send_rp_request(device, instance);
+	slot = &sched_wheel[++sched_now % SCHED_WHEEL_SLOTS];
+	dgram_link_begin();
+	list_for_each_entry_safe(instance, next, slot, wheel)
+	    if (instance->due == sched_now) sched_due(instance);
+	dgram_link_end();
 	    
 	pthread_mutex_unlock(&timer_lock);
     }
@@ -391,95 +1462,231 @@ static void *read_prop_thread(void *arg) {
     return arg;
 }
 
-void add_instance(size_t num_words, uint16_t *data, void *arg) {
-    int bytes;
-    instance_obj *instance;
+void add_instance(size_t num_words, const uint16_t *data, void *arg) {
     device_obj *device = (device_obj *) arg;
-
-    instance = malloc(sizeof(instance_obj));
-    memset(instance, 0, sizeof(instance_obj));
+    instance_obj *instance = &device->by_no[device->num_instances];
 
     instance->parent = device;
     instance->object_type = bacnet_OBJECT_ANALOG_INPUT;
     instance->object_property = bacnet_PROP_PRESENT_VALUE;
     instance->array_index = BACNET_ARRAY_ALL;
 
-    bytes = num_words * sizeof(uint16_t);
     instance->num_words = num_words;
-    instance->instance_no = instance_no++;
+    instance->instance_no = device->num_instances;
 
-    instance->needle = malloc(bytes);
-    instance->haystack = malloc(bytes);
-    memcpy(instance->needle, data, num_words * sizeof(uint16_t));
+    instance->needle = data;
+    instance->prefix = device->prefixes;
+    device->prefixes += num_words;
+    match_init(instance->needle, instance->prefix, num_words);
 
+    pthread_mutex_lock(&timer_lock);
     list_add_tail(&instance->instances, &device->instances);
+    if (device->rpm && device->num_instances % RPM_MAX_INSTANCES) {
+	/* Read by the first instance's requests */
+	rpm_first->rpm_count++;
+	INIT_LIST_HEAD(&instance->wheel);
+    } else {
+	if (device->rpm) {
+	    instance->rpm_count = 1;
+	    rpm_first = instance;
+	}
+	sched_add(instance, SCHED_INTERVAL_MS);
+    }
+    device->num_instances++;
+    pthread_mutex_unlock(&timer_lock);
+}
+
+static void count_words(size_t num_words, const uint16_t *data, void *arg) {
+    size_t *total = (size_t *) arg;
+
+    /* Matcher prefix tables hold 32 bit lengths */
+    if (num_words > UINT32_MAX) {
+	fprintf(stderr, "Channel of %zu words is too long to match\n",
+			num_words);
+	exit(1);
+    }
+    *total += num_words;
 }
 
 void add_device(int device_id) {
     device_obj *device;
+    int num_channels = file_channel_count();
+    size_t num_words = 0;
+
+    if (device_id % shards != shard) return;
 
     device = malloc(sizeof(device_obj));
     memset(device, 0, sizeof(device_obj));
 
+    /* Instances are never added or removed once enumerated, so they share
+     * one allocation with their matchers' prefix tables */
+    file_channel_enumerate(count_words, &num_words);
+    if (num_channels && !(device->by_no =
+			calloc(1, num_channels * sizeof(instance_obj) +
+				num_words * sizeof(uint32_t)))) {
+	fprintf(stderr, "Error allocating instances\n");
+	exit(1);
+    }
+    device->prefixes = (uint32_t *) (device->by_no + num_channels);
+
     device->device_id = device_id;
     INIT_LIST_HEAD(&device->instances);
-    instance_no = 0;
-
+    INIT_LIST_HEAD(&device->pending);
+    device->window = SCHED_WINDOW_INIT;
+    device->whois_backoff = 1;
+    device->rpm = rpm_mode;
+    device->cov = cov_mode != 0;
+
+    /* The timer threads are already walking the list */
+    pthread_mutex_lock(&timer_lock);
     list_add_tail(&device->devices, &devices);
+    device->hash_next = device_hash[device_id % DEVICE_HASH_SIZE];
+    device_hash[device_id % DEVICE_HASH_SIZE] = device;
+    pthread_mutex_unlock(&timer_lock);
 
     file_channel_enumerate(add_instance, device);
 }
 
 void free_devices(void) {
-    device_obj *device;
+    device_obj *device, *next;
     instance_obj *instance;
 
-    list_for_each_entry(device, &devices, devices) {
+    /* Wheel slots and pending lists link instances of different devices, so
+     * they're all unlinked before any are freed */
+    list_for_each_entry(device, &devices, devices)
 	list_for_each_entry(instance, &device->instances, instances) {
-	    free(instance->needle);
-	    free(instance->haystack);
-	    free(instance);
+	    invoke_id_release(instance);
+	    list_del(&instance->wheel);
 	}
+
+    list_for_each_entry_safe(device, next, &devices, devices) {
+	free(device->by_no);
 	free(device);
     }
     INIT_LIST_HEAD(&devices);
 }
 
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-b batch_size] [-B] [-k needle_words] "
+		    "[-p | -c | -C] [-j shards] [-o statistics]\n", program);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
     uint8_t rx_buf[bacnet_MAX_MPDU];
     uint16_t pdu_len;
     BACNET_ADDRESS src;
     pthread_t read_prop_thread_id, minute_tick_id, second_tick_id;
+    struct sigaction sa;
+    struct pollfd pfd;
+    size_t needle_words;
+    char *end;
+    int opt, datalink_benchmark = 0;
+
+    while ((opt = getopt(argc, argv, "b:Bk:pcCj:o:")) != -1) {
+	switch (opt) {
+	    case 'b':
+		batch_size = strtoul(optarg, &end, 10);
+		if (*end || batch_size > DGRAM_BATCH_MAX) usage(argv[0]);
+		break;
+	    case 'B':
+		datalink_benchmark = 1;
+		break;
+	    case 'k':
+		needle_words = strtoul(optarg, &end, 10);
+		if (*end || !needle_words || needle_words > BENCH_SAMPLES)
+		    usage(argv[0]);
+		match_benchmark(needle_words);
+		exit(0);
+	    case 'p':
+		rpm_mode = 1;
+		break;
+	    case 'c':
+		cov_mode = COV_UNCONFIRMED;
+		break;
+	    case 'C':
+		cov_mode = COV_CONFIRMED;
+		break;
+	    case 'j':
+		shards = strtoul(optarg, &end, 10);
+		if (*end || !shards || shards > SHARDS_MAX) usage(argv[0]);
+		break;
+	    case 'o':
+		stats_path = optarg;
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (rpm_mode && cov_mode) usage(argv[0]);
+
+    if (datalink_benchmark) {
+	dgram_benchmark(batch_size ? batch_size : BACNET_BATCH_SIZE);
+	exit(0);
+    }
+
+    fork_shards();
 
     bacnet_Device_Set_Object_Instance_Number(BACNET_MAX_INSTANCE);
     bacnet_address_init();
 
     /* Setup device objects */
     bacnet_Device_Init(client_objects);
-    BN_UNC(I_AM, i_am_bind);
+    bacnet_apdu_set_unconfirmed_handler(SERVICE_UNCONFIRMED_I_AM, i_am);
     BN_CON_ACK(READ_PROPERTY, read_property_ack);
     BN_ERR(READ_PROPERTY, read_property_err);
+    BN_CON_ACK(READ_PROP_MULTIPLE, read_property_multiple_ack);
+    BN_ERR(READ_PROP_MULTIPLE, read_property_err);
+    bacnet_apdu_set_confirmed_simple_ack_handler(
+		    SERVICE_CONFIRMED_SUBSCRIBE_COV, subscribe_cov_ack);
+    BN_ERR(SUBSCRIBE_COV, read_property_err);
+    bacnet_apdu_set_unconfirmed_handler(
+		    SERVICE_UNCONFIRMED_COV_NOTIFICATION, cov_notification);
+    bacnet_apdu_set_confirmed_handler(
+		    SERVICE_CONFIRMED_COV_NOTIFICATION, ccov_notification);
     bacnet_apdu_set_abort_handler(abort_handler);
     bacnet_apdu_set_reject_handler(reject_handler);
 
     bacnet_BIP_Debug = true;
-    bacnet_bip_set_port(htons(BACNET_PORT));
+    bacnet_bip_set_port(htons(shard ? SHARD_PORT_BASE + shard : BACNET_PORT));
     bacnet_datalink_set(BACNET_DATALINK_TYPE);
     bacnet_datalink_init(BACNET_INTERFACE);
     atexit(bacnet_datalink_cleanup);
     memset(&src, 0, sizeof(src));
+    batch_init();
+    sched_init();
 
     register_with_bbmd();
 
+    clock_gettime(CLOCK_MONOTONIC, &stats_start);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
     pthread_create(&read_prop_thread_id, 0, read_prop_thread, NULL);
     pthread_create(&minute_tick_id, 0, minute_tick, NULL);
     pthread_create(&second_tick_id, 0, second_tick, NULL);
 
     file_read_random_data(RANDOM_DATA_POOL);
     file_device_enumerate(add_device);
-    file_free_random_data();
 
-    while (1) {
+    pfd.fd = bacnet_bip_socket();
+    pfd.events = POLLIN;
+
+    while (running) {
+	/* The timers run on their own threads, so there's nothing to do here
+	 * until a packet arrives. Blocks in poll() or select() until then */
+	if (batch_size && BATCH_RECEIVE) {
+	    if (poll(&pfd, 1, BACNET_SELECT_TIMEOUT_MS) <= 0) continue;
+
+	    pthread_mutex_lock(&timer_lock);
+	    dgram_link_receive(bacnet_npdu_handler);
+	    pthread_mutex_unlock(&timer_lock);
+	    continue;
+	}
+
 	pdu_len = bacnet_datalink_receive(
 		    &src, rx_buf, bacnet_MAX_MPDU, BACNET_SELECT_TIMEOUT_MS);
 
@@ -488,14 +1695,19 @@ int main(int argc, char **argv) {
 	     * Thread safety: May block, however we still need to guarantee
 	     * atomicity with the timers, so hold the lock anyway */
 	    pthread_mutex_lock(&timer_lock);
+	    dgram_link_received_direct();
 	    bacnet_npdu_handler(&src, rx_buf, pdu_len);
 	    pthread_mutex_unlock(&timer_lock);
 	}
-
-	ms_tick();
     }
 
+    /* Keep the other threads out until exit */
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&timer_lock);
+    stats_take();
+    stats_write(1);
     free_devices();
+    file_free_random_data();
 
     return 0;
 }
@@ -1,5 +1,7 @@
+#define bacnet_address_add address_add
 #define bacnet_address_bind_request address_bind_request
 #define bacnet_address_cache_timer address_cache_timer
+#define bacnet_address_get_by_index address_get_by_index
 #define bacnet_address_init address_init
 #define bacnet_address_match address_match
 #define bacnet_Analog_Input_Change_Of_Value Analog_Input_Change_Of_Value
@@ -16,23 +18,35 @@
 #define bacnet_Analog_Input_Read_Property Analog_Input_Read_Property
 #define bacnet_Analog_Input_Valid_Instance Analog_Input_Valid_Instance
 #define bacnet_Analog_Input_Write_Property Analog_Input_Write_Property
+#define bacnet_apdu_handler apdu_handler
 #define bacnet_apdu_set_abort_handler apdu_set_abort_handler
 #define bacnet_apdu_set_confirmed_ack_handler apdu_set_confirmed_ack_handler
 #define bacnet_apdu_set_confirmed_handler apdu_set_confirmed_handler
+#define bacnet_apdu_set_confirmed_simple_ack_handler apdu_set_confirmed_simple_ack_handler
 #define bacnet_apdu_set_error_handler apdu_set_error_handler
 #define bacnet_apdu_set_reject_handler apdu_set_reject_handler
 #define bacnet_apdu_set_unconfirmed_handler apdu_set_unconfirmed_handler
 #define bacnet_BIP_Debug BIP_Debug
 #define bacnet_bip_getaddrbyname bip_getaddrbyname
 #define bacnet_bip_set_port bip_set_port
+#define bacnet_bip_socket bip_socket
+#define bacnet_bitstring_init bitstring_init
+#define bacnet_bitstring_set_bit bitstring_set_bit
 #define bacnet_bvlc_maintenance_timer bvlc_maintenance_timer
 #define bacnet_bvlc_register_with_bbmd bvlc_register_with_bbmd
+#define bacnet_characterstring_init_ansi characterstring_init_ansi
+#define bacnet_confirmed_function confirmed_function
+#define bacnet_cov_notify_decode_service_request cov_notify_decode_service_request
 #define bacnet_datalink_cleanup datalink_cleanup
+#define bacnet_datalink_get_broadcast_address datalink_get_broadcast_address
+#define bacnet_datalink_get_my_address datalink_get_my_address
 #define bacnet_datalink_init datalink_init
 #define bacnet_datalink_receive datalink_receive
+#define bacnet_datalink_send_pdu datalink_send_pdu
 #define bacnet_datalink_set datalink_set
 #define bacnet_dcc_timer_seconds dcc_timer_seconds
 #define bacnet_Device_Count Device_Count
+#define bacnet_Device_Vendor_Identifier Device_Vendor_Identifier
 #define bacnet_DeviceGetRRInfo DeviceGetRRInfo
 #define bacnet_Device_Index_To_Instance Device_Index_To_Instance
 #define bacnet_Device_Init Device_Init
@@ -44,24 +58,57 @@
 #define bacnet_Device_Valid_Object_Instance_Number Device_Valid_Object_Instance_Number
 #define bacnet_Device_Write_Property_Local Device_Write_Property_Local
 #define bacnet_dlenv_maintenance_timer dlenv_maintenance_timer
+#define bacnet_encode_application_bitstring encode_application_bitstring
+#define bacnet_encode_application_boolean encode_application_boolean
+#define bacnet_encode_application_character_string encode_application_character_string
+#define bacnet_encode_application_enumerated encode_application_enumerated
+#define bacnet_encode_application_object_id encode_application_object_id
+#define bacnet_encode_application_real encode_application_real
+#define bacnet_encode_application_unsigned encode_application_unsigned
+#define bacnet_handler_ccov_notification handler_ccov_notification
+#define bacnet_handler_cov_fsm handler_cov_fsm
+#define bacnet_handler_cov_init handler_cov_init
+#define bacnet_handler_cov_subscribe handler_cov_subscribe
 #define bacnet_handler_cov_task handler_cov_task
 #define bacnet_handler_cov_timer_seconds handler_cov_timer_seconds
 #define bacnet_handler_i_am_bind handler_i_am_bind
 #define bacnet_handler_read_property handler_read_property
+#define bacnet_handler_read_property_multiple handler_read_property_multiple
 #define bacnet_Handler_Transmit_Buffer Handler_Transmit_Buffer
+#define bacnet_handler_unrecognized_service handler_unrecognized_service
 #define bacnet_handler_who_is handler_who_is
+#define bacnet_iam_decode_service_request iam_decode_service_request
+#define bacnet_iam_encode_apdu iam_encode_apdu
 #define bacnet_Load_Control_State_Machine_Handler Load_Control_State_Machine_Handler
+#define bacnet_MAX_APDU MAX_APDU
 #define bacnet_MAX_MPDU MAX_MPDU
 #define bacnet_Notification_Class_find_recipient Notification_Class_find_recipient
+#define bacnet_npdu_decode npdu_decode
+#define bacnet_npdu_encode_npdu_data npdu_encode_npdu_data
+#define bacnet_npdu_encode_pdu npdu_encode_pdu
 #define bacnet_npdu_handler npdu_handler
 #define bacnet_OBJECT_ANALOG_INPUT OBJECT_ANALOG_INPUT
+#define bacnet_OBJECT_ANALOG_VALUE OBJECT_ANALOG_VALUE
 #define bacnet_OBJECT_DEVICE OBJECT_DEVICE
 #define bacnet_object_functions_t object_functions_t
+#define bacnet_PROP_COV_INCREMENT PROP_COV_INCREMENT
+#define bacnet_PROP_EVENT_STATE PROP_EVENT_STATE
+#define bacnet_PROP_OBJECT_IDENTIFIER PROP_OBJECT_IDENTIFIER
 #define bacnet_PROP_OBJECT_LIST PROP_OBJECT_LIST
+#define bacnet_PROP_OBJECT_NAME PROP_OBJECT_NAME
+#define bacnet_PROP_OBJECT_TYPE PROP_OBJECT_TYPE
+#define bacnet_PROP_OUT_OF_SERVICE PROP_OUT_OF_SERVICE
 #define bacnet_PROP_PRESENT_VALUE PROP_PRESENT_VALUE
+#define bacnet_PROP_RELIABILITY PROP_RELIABILITY
+#define bacnet_PROP_STATUS_FLAGS PROP_STATUS_FLAGS
+#define bacnet_PROP_UNITS PROP_UNITS
 #define bacnet_rp_ack_decode_service_request rp_ack_decode_service_request
 #define bacnet_rp_ack_print_data rp_ack_print_data
+#define bacnet_rp_encode_apdu rp_encode_apdu
+#define bacnet_rpm_ack_decode_service_request rpm_ack_decode_service_request
+#define bacnet_Send_COV_Subscribe Send_COV_Subscribe
 #define bacnet_Send_I_Am Send_I_Am
+#define bacnet_Send_Read_Property_Multiple_Request Send_Read_Property_Multiple_Request
 #define bacnet_Send_Read_Property_Request Send_Read_Property_Request
 #define bacnet_Send_WhoIs Send_WhoIs
 #define bacnet_trend_log_timer trend_log_timer
@@ -69,3 +116,4 @@
 #define bacnet_tsm_invoke_id_failed tsm_invoke_id_failed
 #define bacnet_tsm_invoke_id_free tsm_invoke_id_free
 #define bacnet_tsm_timer_milliseconds tsm_timer_milliseconds
+#define bacnet_whois_decode_service_request whois_decode_service_request
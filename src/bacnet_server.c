@@ -8,25 +8,40 @@
 #include <libbacnet/client.h>
 #include <libbacnet/txbuf.h>
 #include <libbacnet/tsm.h>
-#include <libbacnet/ai.h>
+#include <libbacnet/bacdcode.h>
+#include <libbacnet/bacstr.h>
 #include "bacnet_namespace.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <math.h>
 #include <modbus.h>
 #include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "dgram_batch.h"
+#include "shm_regs.h"
+#include "rtt_histogram.h"
 
 #define SERVER_ADDR "140.159.153.159" // ip address
 #define SERVER_PORT 502
 #define DATA_LENGTH 256
 
-#define NUM_LISTS 2
 #define LISTEN_BACKLOG 1
 #define QUIT_STRING "exit"
 
@@ -41,7 +56,8 @@
 #define BACNET_PORT		    0xBAC1
 #define BACNET_INTERFACE	    "lo"
 #define BACNET_DATALINK_TYPE	    "bvlc"
-#define BACNET_SELECT_TIMEOUT_MS    1	    /* ms */
+#define BACNET_BATCH_SIZE	    32	    /* datagrams, 0 for no batching */
+#define BACNET_VIRTUAL_NETWORK	    1001    /* Network of the virtual devices */
 
 #define RUN_AS_BBMD_CLIENT	    1
 
@@ -54,260 +70,2307 @@
 #define BACNET_BBMD_TTL		    90
 #endif
 
-/* If you are trying out the test suite from home, this data matches the data
- * stored in RANDOM_DATA_POOL for device number 12
- * BACnet client will print "Successful match" whenever it is able to receive
- * this set of data. Note that you will not have access to the RANDOM_DATA_POOL
- * for your final submitted application. */
-static uint16_t test_data[] = {
-    0xA4EC, 0x6E39, 0x8740, 0x1065, 0x9134, 0xFC8C };
-#define NUM_TEST_DATA (sizeof(test_data)/sizeof(test_data[0]))
+/* Received datagrams are only batched as a foreign device, see
+ * dgram_link_init() */
+#define BATCH_RECEIVE		    RUN_AS_BBMD_CLIENT
+
+/* Each Analog Input instance is fed from a bounded sample queue. The Modbus
+ * thread enqueues in constant time and never allocates; if the BACnet client
+ * polls more slowly than the Modbus loop, the queue overflows according to its
+ * policy instead of growing without limit. The policy is chosen with -q */
+#define QUEUE_LENGTH		    64	    /* samples, must be a power of 2 */
+#define QUEUE_POLICY_DEFAULT	    QUEUE_DROP_OLDEST
+
+/* Queue overflow policies */
+#define QUEUE_DROP_OLDEST	    0	    /* Overwrite the oldest sample */
+#define QUEUE_DROP_NEWEST	    1	    /* Discard the incoming sample */
+#define QUEUE_LATEST_ONLY	    2	    /* Hold only the newest sample */
+
+typedef struct sample_queue_s sample_queue;
+struct sample_queue_s {
+    uint16_t		data[QUEUE_LENGTH];
+    uint64_t		*read_ns;   /* Time each sample was read, with -r */
+    unsigned		head;	    /* Free running read index */
+    unsigned		tail;	    /* Free running write index */
+    int			policy;
+
+    /* Statistics, used to size QUEUE_LENGTH */
+    unsigned		high_water;
+    unsigned long	enqueued;
+    unsigned long	dropped;
+};
+
+static const char *const queue_policy_names[] = {
+    "oldest", "newest", "latest", NULL
+};
+
+static int queue_policy = QUEUE_POLICY_DEFAULT;
+
+/* One queue per point, indexed by point slot. Shared between the modbus and
+ * BACnet threads, must be accessed with queue_lock held */
+static sample_queue *queues;
+static int num_queues;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bridge diagnostics, served as Analog Value objects with -i. Both threads
+ * only add to these counters, with relaxed atomics so that neither needs
+ * queue_lock to read them. Every DIAG_PERIOD_S seconds the BACnet thread
+ * takes the per-period counts and works out the values it serves; the
+ * totals are never reset */
+#define DIAG_PERIOD_S		    10
+
+typedef struct diag_counters_s diag_counters;
+struct diag_counters_s {
+    /* Per period */
+    unsigned long	rtt_count;
+    unsigned long	rtt_total_us;
+    unsigned long	rtt_buckets[RTT_HISTOGRAM_BUCKETS];
+    unsigned long	requests;   /* ReadProperty and ReadPropertyMultiple */
+    unsigned long	handler_ns;
+
+    /* Totals */
+    long		queued;	    /* Samples in all queues */
+    unsigned long	dropped;
+    unsigned long	reconnects;
+};
+
+static int diag_enabled;
+static diag_counters diag;
+
+#define diag_add(counter, n) \
+    __atomic_fetch_add(&diag.counter, (n), __ATOMIC_RELAXED)
+#define diag_take(counter) \
+    __atomic_exchange_n(&diag.counter, 0, __ATOMIC_RELAXED)
+#define diag_read(counter) \
+    __atomic_load_n(&diag.counter, __ATOMIC_RELAXED)
+
+static void diag_poll_rtt(float rtt_ms) {
+    unsigned long us = rtt_ms * 1000;
+
+    diag_add(rtt_count, 1);
+    diag_add(rtt_total_us, us);
+    diag_add(rtt_buckets[rtt_histogram_bucket(us)], 1);
+}
+
+/* Real-time mode. With -r, memory is locked, the BACnet, modbus and shm
+ * threads run SCHED_FIFO and nothing on the request path uses stdio. They
+ * share a priority, so each is pinned to a CPU of its own: on one CPU, a
+ * thread that was busy would starve the others. Every buffer on the data
+ * path is already allocated at startup. The latency from each sample's
+ * Modbus read until the BACnet reply that carries it has been sent is kept
+ * in a histogram, reported once a minute, or by the read to reply benchmark
+ * (-B) when it finishes */
+#define RT_PRIORITY		    50
+#define RT_BACNET_CPU		    0	    /* -1 to leave unpinned */
+#define RT_MODBUS_CPU		    1
+#define RT_SHM_CPU		    2
+#define RT_SERVED_MAX		    1024    /* Samples timed per batch */
+
+/* Read to reply benchmark (-B), see rt_benchmark() */
+#define BENCH_SAMPLES		    100000
+#define BENCH_TIMEOUT_MS	    100
+
+static int rt_mode;
+static int rt_timing;	    /* Samples are timed, with -r or -B */
+
+/* Only accessed from the BACnet thread */
+static unsigned long rt_latency[RTT_HISTOGRAM_BUCKETS];
+static unsigned long rt_latency_max_us;
+
+/* Read times of the samples encoded into replies not yet sent */
+static uint64_t rt_served[RT_SERVED_MAX];
+static unsigned rt_num_served;
+
+static void rt_thread(const char *name, int cpu) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
+
+    if (!rt_mode) return;
+
+    if (cpu >= 0) {
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+				    &cpus)))
+	    fprintf(stderr, "Unable to pin %s thread to CPU %i: %s\n",
+			    name, cpu, strerror(err));
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = RT_PRIORITY;
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)))
+	fprintf(stderr, "Unable to make %s thread SCHED_FIFO: %s\n",
+			name, strerror(err));
+}
+
+static void rt_latency_record(uint64_t read_ns, uint64_t sent_ns) {
+    unsigned long us;
+
+    if (!read_ns || sent_ns < read_ns) return;
+
+    us = (sent_ns - read_ns) / 1000;
+    rt_latency[rtt_histogram_bucket(us)]++;
+    if (us > rt_latency_max_us) rt_latency_max_us = us;
+}
+
+/* A sample read at read_ns has been encoded into a reply. It's timed once
+ * the reply has been sent. Any beyond RT_SERVED_MAX in one batch aren't */
+static void rt_latency_served(uint64_t read_ns) {
+    if (read_ns && rt_num_served < RT_SERVED_MAX)
+	rt_served[rt_num_served++] = read_ns;
+}
+
+/* The replies to the requests just handled have been sent */
+static void rt_latency_sent(void) {
+    struct timespec now;
+    uint64_t sent_ns;
+    unsigned i;
+
+    if (!rt_num_served) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sent_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    for (i = 0; i < rt_num_served; i++)
+	rt_latency_record(rt_served[i], sent_ns);
+    rt_num_served = 0;
+}
+
+/* The Modbus read to BACnet reply latency distribution since the last
+ * report. Percentiles are the upper bound of their histogram bucket */
+static void rt_report(void) {
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    unsigned long total = 0, count = 0, result[4];
+    unsigned i, j = 0;
+
+    if (!rt_timing) return;
+
+    for (i = 0; i < RTT_HISTOGRAM_BUCKETS; i++) total += rt_latency[i];
+    if (!total) return;
+
+    for (i = 0; i < RTT_HISTOGRAM_BUCKETS && j < 4; i++) {
+	count += rt_latency[i];
+	while (j < 4 && count >= total * percentiles[j] / 100)
+	    result[j++] = rtt_histogram_bucket_us(i + 1);
+    }
+
+    fprintf(stderr, "Read to reply latency: %lu samples, p50 %lu us, "
+		    "p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us, "
+		    "jitter (p99 - p50) %lu us\n", total,
+		    result[0], result[1], result[2], result[3],
+		    rt_latency_max_us, result[2] - result[0]);
+
+    memset(rt_latency, 0, sizeof(rt_latency));
+    rt_latency_max_us = 0;
+}
+
+static void queue_init(sample_queue *queue, int policy) {
+    memset(queue, 0, sizeof(sample_queue));
+    queue->policy = policy;
+
+    if (rt_timing && !(queue->read_ns =
+		    calloc(QUEUE_LENGTH, sizeof(uint64_t)))) {
+	fprintf(stderr, "Error allocating sample queue\n");
+	exit(1);
+    }
+}
+
+static unsigned queue_depth(sample_queue *queue) {
+    return queue->tail - queue->head;
+}
+
+/* The most samples the queue holds */
+static unsigned queue_limit(sample_queue *queue) {
+    return queue->policy == QUEUE_LATEST_ONLY ? 1 : QUEUE_LENGTH;
+}
+
+/* Add a sample to the tail of the queue. Must be called with queue_lock held */
+static void queue_put(sample_queue *queue, uint16_t data, uint64_t read_ns) {
+    queue->enqueued++;
+
+    if (queue_depth(queue) >= queue_limit(queue)) {
+	queue->dropped++;
+	diag_add(dropped, 1);
+	if (queue->policy == QUEUE_DROP_NEWEST) return;
+
+	/* QUEUE_DROP_OLDEST and QUEUE_LATEST_ONLY: discard the head */
+	queue->head++;
+    } else {
+	diag_add(queued, 1);
+    }
+
+    if (queue->read_ns)
+	queue->read_ns[queue->tail & (QUEUE_LENGTH - 1)] = read_ns;
+    queue->data[queue->tail++ & (QUEUE_LENGTH - 1)] = data;
+
+    if (queue_depth(queue) > queue->high_water)
+	queue->high_water = queue_depth(queue);
+}
+
+/* Retrieve the sample at the head of the queue. Returns 0 if the queue is
+ * empty. Must be called with queue_lock held */
+static int queue_get(sample_queue *queue, uint16_t *data,
+			uint64_t *read_ns) {
+    if (!queue_depth(queue)) return 0;
+
+    if (read_ns && queue->read_ns)
+	*read_ns = queue->read_ns[queue->head & (QUEUE_LENGTH - 1)];
+    *data = queue->data[queue->head++ & (QUEUE_LENGTH - 1)];
+    diag_add(queued, -1);
+    return 1;
+}
+
+/* Summarise queue usage across all points: the deepest queue is the one that
+ * determines whether QUEUE_LENGTH is large enough */
+static void queue_report(void) {
+    unsigned long depth = 0, enqueued = 0, dropped = 0;
+    int i, deepest = 0;
+
+    if (!num_queues) return;
+
+    pthread_mutex_lock(&queue_lock);
+    for (i = 0; i < num_queues; i++) {
+	depth += queue_depth(&queues[i]);
+	enqueued += queues[i].enqueued;
+	dropped += queues[i].dropped;
+	if (queues[i].high_water > queues[deepest].high_water) deepest = i;
+    }
+    fprintf(stderr, "Queues: %i points, depth %lu, high water %u/%u "
+		    "(slot %i), enqueued %lu, dropped %lu\n",
+		    num_queues, depth, queues[deepest].high_water,
+		    queue_limit(&queues[deepest]), deepest, enqueued, dropped);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+//-=====================================================================
+//----------------ADD MODBUS PROGRAM HERE--------------------------
+//======================================================================
+
+
+/* Point table: each Analog Input instance is backed by one Modbus holding
+ * register on one of mb_servers. Points in the same poll group share a poll
+ * interval, and the scheduler merges points of a group on the same server
+ * whose registers lie within the group's gap tolerance into a single FC3
+ * request. The table is loaded from the point map at startup; see
+ * point_map_load() */
+typedef struct poll_group_s poll_group;
+struct poll_group_s {
+    char		*name;
+    unsigned		interval_ms;
+    int			gap;	    /* Unused registers allowed in a request */
+};
+
+/* Points are sorted by device and instance, and a point's index in
+ * poll_points is its slot: the index of its sample queue and Analog Input
+ * data */
+typedef struct poll_point_s poll_point;
+struct poll_point_s {
+    int			device;	    /* Index into bridge_devices */
+    uint32_t		instance;   /* Analog Input instance */
+    int			server;	    /* Index into mb_servers */
+    int			reg;	    /* Modbus holding register */
+    int			group;	    /* Index into poll_groups */
+    float		cov_increment;
+};
+
+typedef struct poll_request_s poll_request;
+struct poll_request_s {
+    int			server;
+    int			start;	    /* First register */
+    int			count;	    /* Number of registers */
+    int			group;
+    int			in_flight;
+    int			idle;	    /* Polled at POLL_IDLE_INTERVAL_MS */
+    struct timespec	due;
+
+    /* Points served by this request, sorted by register */
+    const poll_point	**points;
+    int			num_points;
+};
+
+/* Modbus TCP client pool: one non-blocking connection per server, with up to
+ * MB_WINDOW requests in flight on each. Responses are matched to requests by
+ * MBAP transaction id. Everything is driven from the modbus thread's epoll
+ * loop, so one slow PLC doesn't hold up the others. */
+#define MB_WINDOW		    4	    /* Requests in flight per server */
+#define MB_RESPONSE_TIMEOUT_MS	    1000
+#define MB_BACKOFF_MIN_MS	    100
+#define MB_BACKOFF_MAX_MS	    30000
+#define MB_UNIT_ID		    0xFF
+#define MB_REQUEST_LENGTH	    12
+#define MB_MAX_EVENTS		    16
+
+#define MB_DISCONNECTED		    0
+#define MB_CONNECTING		    1
+#define MB_CONNECTED		    2
+#define MB_UNRESOLVED		    3	    /* Never polled */
+#define MB_SHM			    4	    /* Read by the shm thread */
+
+typedef struct mb_transaction_s mb_transaction;
+struct mb_transaction_s {
+    poll_request	*request;   /* NULL if the slot is free */
+    uint16_t		tid;
+    struct timespec	sent;
+    struct timespec	deadline;
+};
+
+typedef struct mb_server_s mb_server;
+struct mb_server_s {
+    char		*name;
+    char		*host;
+    int			port;
+    int			shm;	    /* Host "shm": modbus_server -s */
+
+    struct sockaddr_in	addr;
+    int			fd;
+    int			state;
+    struct timespec	deadline;   /* Next connection attempt or timeout */
+    unsigned		backoff_ms;
+    unsigned long	reconnects;
+
+    uint16_t		next_tid;
+    int			in_flight;
+    mb_transaction	window[MB_WINDOW];
+
+    uint8_t		rx_buf[MODBUS_TCP_MAX_ADU_LENGTH];
+    size_t		rx_len;
+    uint8_t		tx_buf[MB_WINDOW * MB_REQUEST_LENGTH];
+    size_t		tx_len;
+};
+
+/* Built at startup, read only afterwards */
+static mb_server *mb_servers;
+static int num_mb_servers;
+static poll_group *poll_groups;
+static int num_poll_groups;
+static poll_point *poll_points;
+static int num_poll_points;
+
+/* BACnet devices served by this process. bridge_devices[0] is our own
+ * device, which also routes to BACNET_VIRTUAL_NETWORK. Any others are virtual
+ * devices on that network, with their index as a 2 byte MAC address. Each
+ * device's points are a contiguous range of slots sorted by instance, found
+ * from their instance numbers with an open addressing hash table sized by the
+ * number of points, so instance numbers may be as sparse as the point map
+ * likes */
+#define AI_HASH_LOAD		    2	    /* Table entries per point, at least */
+#define AI_HASH_EMPTY		    -1
+
+typedef struct bridge_device_s bridge_device;
+struct bridge_device_s {
+    uint32_t		instance;
+    char		*name;	    /* NULL for our own device */
+    int			first_slot;
+    int			num_points;
+    int			*ai_hash;   /* Slots, or AI_HASH_EMPTY */
+    unsigned		ai_hash_bits;
+};
+
+static bridge_device *bridge_devices;
+static int num_bridge_devices;
+
+/* The device whose objects are being served, only accessed from the BACnet
+ * thread. Our own device except while routing a request to a virtual one */
+static bridge_device *current_device;
+
+/* Present_Value of each point, only accessed from the BACnet thread */
+static float *ai_present_values;
+
+/* Latest value cache: the most recent sample of each point, the monotonic
+ * time it was read and the round trip time of the poll that read it. A point
+ * is stale once it hasn't been refreshed for its poll interval plus the
+ * response timeout, and reports a communication failure until the next
+ * successful read. Shared between the modbus and BACnet threads, must be
+ * accessed with queue_lock held */
+typedef struct ai_sample_s ai_sample;
+struct ai_sample_s {
+    float		value;
+    struct timespec	time;	    /* Zero until the first read */
+    float		rtt_ms;
+    int			restored;   /* From the snapshot, not yet read */
+};
+
+static ai_sample *ai_samples;
+
+/* Change of value state of each point. The modbus thread compares every new
+ * sample with the value last notified to COV subscribers and flags the point
+ * once it has moved by at least the point's COV increment. A change in
+ * staleness is also notified, as it changes Status_Flags. Shared between
+ * the modbus and BACnet threads, must be accessed with queue_lock held */
+#define COV_INCREMENT_DEFAULT	    1.0
+
+typedef struct ai_cov_s ai_cov;
+struct ai_cov_s {
+    float		reported;   /* Value at the last notification */
+    int			stale;	    /* Staleness at the last notification */
+    int			changed;
+};
+
+static ai_cov *ai_covs;
+
+/* The modbus thread signals cov_event_fd when a point changes, unless a
+ * signal is already pending. cov_event_pending is protected by queue_lock */
+static int cov_event_fd = -1;
+static int cov_event_pending;
+
+/* Demand driven polling. With -d, a request is only polled at its group's
+ * interval while one of its points is in demand: its Present_Value has been
+ * read or a COV subscriber has checked it within POLL_DEMAND_MS, or its queue
+ * is below QUEUE_LOW_WATER (empty for a latest only queue). Otherwise it
+ * falls back to POLL_IDLE_INTERVAL_MS. The BACnet thread records demand,
+ * and signals poll_wake_fd when a point of an idle request is read so that
+ * polling resumes without waiting out the idle interval. Shared between the
+ * modbus and BACnet threads, must be accessed with queue_lock held */
+#define POLL_DEMAND_MS		    30000
+#define POLL_IDLE_INTERVAL_MS	    10000
+#define QUEUE_LOW_WATER		    4	    /* samples */
+
+typedef struct poll_demand_s poll_demand;
+struct poll_demand_s {
+    struct timespec	last;	    /* Last read or COV check */
+    int			idle;	    /* Its request is polled when idle */
+};
+
+static int poll_adaptive;
+static poll_demand *poll_demands;
+static int poll_wake_fd = -1;
+
+/* Built at startup. The modbus thread owns the scheduling state of each
+ * request (in_flight, idle and due). The shm thread only reads the register
+ * ranges and points of requests on shm servers, which never change */
+static poll_request *poll_requests;
+static int num_poll_requests;
+static int mb_epoll_fd;
+
+static void timespec_add_ms(struct timespec *ts, unsigned ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec;
+    return a->tv_nsec < b->tv_nsec;
+}
+
+/* Milliseconds from now until ts, rounded up. Negative if ts has passed */
+static long timespec_ms_until(const struct timespec *ts,
+			const struct timespec *now) {
+    return (ts->tv_sec - now->tv_sec) * 1000 +
+	    (ts->tv_nsec - now->tv_nsec + 999999) / 1000000;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static float timespec_ms_since(const struct timespec *ts,
+			const struct timespec *now) {
+    return (now->tv_sec - ts->tv_sec) * 1000.0 +
+	    (now->tv_nsec - ts->tv_nsec) / 1000000.0;
+}
+
+static int poll_point_compare(const void *a, const void *b) {
+    const poll_point *point_a = *(const poll_point **) a;
+    const poll_point *point_b = *(const poll_point **) b;
+
+    if (point_a->group != point_b->group)
+	return point_a->group - point_b->group;
+    if (point_a->server != point_b->server)
+	return point_a->server - point_b->server;
+    return point_a->reg - point_b->reg;
+}
+
+/* Coalesce the poll table into the fewest FC3 requests, then stagger the
+ * first poll of each request across its group's interval so that requests
+ * sharing an interval don't all fall due at once */
+static void poll_build_requests(void) {
+    const poll_point **sorted;
+    poll_request *request = NULL;
+    struct timespec now;
+    unsigned interval;
+    int i, j, k;
+
+    /* Worst case is one request per point */
+    sorted = malloc(num_poll_points * sizeof(*sorted));
+    poll_requests = calloc(num_poll_points, sizeof(poll_request));
+    if (!sorted || !poll_requests) {
+	fprintf(stderr, "Error allocating poll requests\n");
+	exit(1);
+    }
+
+    for (i = 0; i < num_poll_points; i++) sorted[i] = &poll_points[i];
+    qsort(sorted, num_poll_points, sizeof(*sorted), poll_point_compare);
+
+    for (i = 0; i < num_poll_points; i++) {
+	if (!request || request->group != sorted[i]->group ||
+		request->server != sorted[i]->server ||
+		sorted[i]->reg - (request->start + request->count) >
+			poll_groups[request->group].gap ||
+		sorted[i]->reg - request->start >= MODBUS_MAX_READ_REGISTERS) {
+
+	    request = &poll_requests[num_poll_requests++];
+	    request->server = sorted[i]->server;
+	    request->start = sorted[i]->reg;
+	    request->group = sorted[i]->group;
+	    request->points = &sorted[i];
+	}
+	request->count = sorted[i]->reg - request->start + 1;
+	request->num_points++;
+    }
+
+    /* Requests belonging to one group are contiguous */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < num_poll_requests; i = j) {
+	for (j = i; j < num_poll_requests &&
+		poll_requests[j].group == poll_requests[i].group; j++);
+
+	interval = poll_groups[poll_requests[i].group].interval_ms;
+	for (k = i; k < j; k++) {
+	    poll_requests[k].due = now;
+	    timespec_add_ms(&poll_requests[k].due,
+			    (k - i) * interval / (j - i));
+	}
+    }
+
+    fprintf(stderr, "Polling %i points with %i Modbus requests\n",
+		    num_poll_points, num_poll_requests);
+}
+
+static void *point_map_grow(void *array, int count, size_t size) {
+    /* Double the allocation whenever count reaches a power of 2 */
+    if (count & (count - 1)) return array;
+
+    if (!(array = realloc(array, (count ? count * 2 : 1) * size))) {
+	fprintf(stderr, "Out of memory loading point map\n");
+	exit(1);
+    }
+    return array;
+}
+
+static void point_map_add_server(const char *name, const char *host,
+			int port) {
+    mb_server *server;
+
+    mb_servers = point_map_grow(mb_servers, num_mb_servers,
+		    sizeof(mb_server));
+    server = &mb_servers[num_mb_servers++];
+    memset(server, 0, sizeof(mb_server));
+
+    server->name = strdup(name);
+    server->host = strdup(host);
+    server->port = port;
+    server->shm = !strcmp(host, "shm");
+}
+
+static void point_map_add_group(const char *name, unsigned interval_ms,
+			int gap) {
+    poll_group *group;
+
+    poll_groups = point_map_grow(poll_groups, num_poll_groups,
+		    sizeof(poll_group));
+    group = &poll_groups[num_poll_groups++];
+
+    group->name = strdup(name);
+    group->interval_ms = interval_ms;
+    group->gap = gap;
+}
+
+static void point_map_add_device(uint32_t instance, const char *name) {
+    bridge_device *device;
+
+    bridge_devices = point_map_grow(bridge_devices, num_bridge_devices,
+		    sizeof(bridge_device));
+    device = &bridge_devices[num_bridge_devices++];
+    memset(device, 0, sizeof(bridge_device));
+
+    device->instance = instance;
+    device->name = name ? strdup(name) : NULL;
+}
+
+static void point_map_add_point(int device, uint32_t instance, int server,
+			int reg, int group, float cov_increment) {
+    poll_point *point;
+
+    poll_points = point_map_grow(poll_points, num_poll_points,
+		    sizeof(poll_point));
+    point = &poll_points[num_poll_points++];
+
+    point->device = device;
+    point->instance = instance;
+    point->server = server;
+    point->reg = reg;
+    point->group = group;
+    point->cov_increment = cov_increment;
+}
+
+/* Without a point map, serve device 110's two registers from the class
+ * Modbus server. Register numbers match the BACnet device number */
+static void point_map_default(void) {
+    point_map_add_server("default", SERVER_ADDR, SERVER_PORT);
+    point_map_add_group("default", 100, 8);
+    point_map_add_point(0, 0, 0, 110, 0, COV_INCREMENT_DEFAULT);
+    point_map_add_point(0, 1, 0, 111, 0, COV_INCREMENT_DEFAULT);
+}
+
+static int point_map_find_server(const char *name) {
+    int i;
+
+    for (i = 0; i < num_mb_servers; i++)
+	if (!strcmp(mb_servers[i].name, name)) return i;
+    return -1;
+}
+
+static int point_map_find_group(const char *name) {
+    int i;
+
+    for (i = 0; i < num_poll_groups; i++)
+	if (!strcmp(poll_groups[i].name, name)) return i;
+    return -1;
+}
+
+static int point_map_find_device(uint32_t instance) {
+    int i;
+
+    for (i = 0; i < num_bridge_devices; i++)
+	if (bridge_devices[i].instance == instance) return i;
+    return -1;
+}
+
+/* Point map format, one entry per line, '#' starts a comment:
+ *
+ *	server <name> <host> [port]
+ *	group <name> <interval ms> <gap>
+ *	device <instance> [name]
+ *	ai <instance> <server name> <register> [group name] [COV increment]
+ *
+ * Servers and groups must be declared before the points that use them. A
+ * point without a group joins the first group declared. Points belong to the
+ * last virtual device declared, or to our own device before the first */
+static void point_map_load(const char *filename) {
+    char keyword[16], name[64], host[256], group_name[64];
+    char *line = NULL, *comment;
+    size_t line_size = 0;
+    unsigned instance, interval_ms;
+    float cov_increment;
+    int line_no = 0, port, gap, reg, server, group, fields, device = 0;
+    FILE *fp;
+
+    if (!(fp = fopen(filename, "r"))) {
+	fprintf(stderr, "Unable to open point map %s: %s\n",
+			filename, strerror(errno));
+	exit(1);
+    }
+
+    while (getline(&line, &line_size, fp) >= 0) {
+	line_no++;
+	if ((comment = strchr(line, '#'))) *comment = '\0';
+	if (sscanf(line, "%15s", keyword) != 1) continue;
+
+	if (!strcmp(keyword, "server")) {
+	    port = MODBUS_TCP_DEFAULT_PORT;
+	    if (sscanf(line, "%*s %63s %255s %i", name, host, &port) < 2)
+		goto bad_line;
+	    point_map_add_server(name, host, port);
+
+	} else if (!strcmp(keyword, "group")) {
+	    if (sscanf(line, "%*s %63s %u %i",
+				name, &interval_ms, &gap) != 3 ||
+		    !interval_ms || gap < 0)
+		goto bad_line;
+	    point_map_add_group(name, interval_ms, gap);
+
+	} else if (!strcmp(keyword, "device")) {
+	    fields = sscanf(line, "%*s %u %63s", &instance, name);
+	    if (fields < 1 || instance >= BACNET_MAX_INSTANCE)
+		goto bad_line;
+	    if (fields < 2) snprintf(name, sizeof(name), "DEVICE %u", instance);
+
+	    if (point_map_find_device(instance) >= 0) {
+		fprintf(stderr, "%s:%i: duplicate device %u\n",
+				filename, line_no, instance);
+		exit(1);
+	    }
+	    point_map_add_device(instance, name);
+	    device = num_bridge_devices - 1;
+
+	} else if (!strcmp(keyword, "ai")) {
+	    cov_increment = COV_INCREMENT_DEFAULT;
+	    fields = sscanf(line, "%*s %u %63s %i %63s %f",
+			    &instance, name, &reg, group_name, &cov_increment);
+	    if (fields < 3 || instance >= BACNET_MAX_INSTANCE ||
+		    reg < 0 || reg > 0xFFFF || cov_increment < 0)
+		goto bad_line;
+
+	    if ((server = point_map_find_server(name)) < 0) {
+		fprintf(stderr, "%s:%i: unknown server %s\n",
+				filename, line_no, name);
+		exit(1);
+	    }
+
+	    group = fields < 4 ? 0 : point_map_find_group(group_name);
+	    if (group < 0 || group >= num_poll_groups) {
+		fprintf(stderr, "%s:%i: unknown group\n", filename, line_no);
+		exit(1);
+	    }
+
+	    point_map_add_point(device, instance, server, reg, group,
+			    cov_increment);
+
+	} else {
+	    goto bad_line;
+	}
+    }
+
+    free(line);
+    fclose(fp);
+    return;
+
+bad_line:
+    fprintf(stderr, "%s:%i: invalid entry\n", filename, line_no);
+    exit(1);
+}
+
+static int poll_point_instance_compare(const void *a, const void *b) {
+    const poll_point *point_a = a, *point_b = b;
+
+    if (point_a->device != point_b->device)
+	return point_a->device - point_b->device;
+    if (point_a->instance == point_b->instance) return 0;
+    return point_a->instance < point_b->instance ? -1 : 1;
+}
+
+static unsigned ai_hash(const bridge_device *device, uint32_t instance) {
+    /* Fibonacci hashing, the top bits of the product */
+    return (uint32_t) (instance * 2654435769U) >> (32 - device->ai_hash_bits);
+}
+
+/* Build a device's table of its points by instance */
+static void ai_hash_init(bridge_device *device) {
+    unsigned size, entry;
+    int slot;
+
+    for (device->ai_hash_bits = 1, size = 2;
+	    size < (unsigned) device->num_points * AI_HASH_LOAD; size *= 2)
+	device->ai_hash_bits++;
+
+    if (!(device->ai_hash = malloc(size * sizeof(int)))) {
+	fprintf(stderr, "Error allocating points\n");
+	exit(1);
+    }
+    for (entry = 0; entry < size; entry++)
+	device->ai_hash[entry] = AI_HASH_EMPTY;
+
+    for (slot = device->first_slot;
+	    slot < device->first_slot + device->num_points; slot++) {
+	entry = ai_hash(device, poll_points[slot].instance);
+	while (device->ai_hash[entry] != AI_HASH_EMPTY)
+	    entry = (entry + 1) & (size - 1);
+	device->ai_hash[entry] = slot;
+    }
+}
+
+/* Assign point slots in device and instance order, find each device's range
+ * of slots and allocate per-point data */
+static void point_map_index(void) {
+    bridge_device *device;
+    int i, j, k;
+
+    if (!num_poll_points) {
+	fprintf(stderr, "Point map has no Analog Input points\n");
+	exit(1);
+    }
+
+    qsort(poll_points, num_poll_points, sizeof(poll_point),
+		    poll_point_instance_compare);
+
+    for (i = 0; i < num_poll_points; i = j) {
+	device = &bridge_devices[poll_points[i].device];
+	for (j = i; j < num_poll_points &&
+		poll_points[j].device == poll_points[i].device; j++);
+
+	device->first_slot = i;
+	device->num_points = j - i;
+
+	for (k = i + 1; k < j; k++) {
+	    if (poll_points[k].instance == poll_points[k - 1].instance) {
+		fprintf(stderr, "Duplicate Analog Input instance %u "
+				"in device %u\n",
+				poll_points[k].instance, device->instance);
+		exit(1);
+	    }
+	}
+	ai_hash_init(device);
+    }
+    current_device = bridge_devices;
+
+    num_queues = num_poll_points;
+    queues = malloc(num_queues * sizeof(sample_queue));
+    ai_present_values = calloc(num_poll_points, sizeof(float));
+    ai_samples = calloc(num_poll_points, sizeof(ai_sample));
+    ai_covs = calloc(num_poll_points, sizeof(ai_cov));
+    poll_demands = calloc(num_poll_points, sizeof(poll_demand));
+
+    if (!queues || !ai_present_values || !ai_samples || !ai_covs ||
+		    !poll_demands) {
+	fprintf(stderr, "Error allocating points\n");
+	exit(1);
+    }
+
+    for (i = 0; i < num_queues; i++) queue_init(&queues[i], queue_policy);
+    for (i = 0; i < num_poll_points; i++) ai_covs[i].stale = 1;
+}
+
+/* Warm start snapshot. With -s, each point's latest sample and libbacnet's
+ * address cache are kept in a memory mapped file. The modbus thread updates
+ * a point's record in place each time it's read, so the file is current
+ * without any writes of our own. On startup, the records of points that are
+ * still in the point map are loaded into the latest value cache and served
+ * straight away, stale until the point is next read. Times are wall clock
+ * times, as the monotonic clock restarts with the host */
+#define SNAPSHOT_MAGIC		    0x424d5353	/* "SSMB" */
+#define SNAPSHOT_VERSION	    1
+#define SNAPSHOT_ADDRESSES	    255	    /* libbacnet's MAX_ADDRESS_CACHE */
+
+typedef struct snapshot_point_s snapshot_point;
+struct snapshot_point_s {
+    uint32_t		device;	    /* Device instance */
+    uint32_t		instance;
+    uint32_t		valid;	    /* Zero until the first read */
+    float		value;
+    float		rtt_ms;
+    struct timespec	time;	    /* CLOCK_REALTIME of the read */
+};
+
+typedef struct snapshot_address_s snapshot_address;
+struct snapshot_address_s {
+    uint32_t		device;
+    uint32_t		max_apdu;
+    BACNET_ADDRESS	address;
+};
+
+/* The file is the header, then a record per point in slot order, then the
+ * address cache */
+typedef struct snapshot_header_s snapshot_header;
+struct snapshot_header_s {
+    uint32_t		magic;
+    uint32_t		version;
+    uint32_t		num_points;
+    uint32_t		num_addresses;
+};
+
+#define SNAPSHOT_SIZE(points) (sizeof(snapshot_header) + \
+		(points) * sizeof(snapshot_point) + \
+		SNAPSHOT_ADDRESSES * sizeof(snapshot_address))
+
+static snapshot_header *snapshot;
+static snapshot_point *snapshot_points;	    /* Updated with queue_lock held */
+static snapshot_address *snapshot_addresses;	    /* BACnet thread only */
+
+static int snapshot_point_compare(const void *a, const void *b) {
+    const snapshot_point *point_a = a, *point_b = b;
+
+    if (point_a->device != point_b->device)
+	return point_a->device < point_b->device ? -1 : 1;
+    if (point_a->instance == point_b->instance) return 0;
+    return point_a->instance < point_b->instance ? -1 : 1;
+}
+
+/* Copy the valid records out of an existing snapshot, sorted for lookup.
+ * Returns the number of records, 0 if the file isn't a usable snapshot */
+static int snapshot_read_old(int fd, snapshot_point **points,
+			snapshot_address **addresses) {
+    snapshot_header *old;
+    struct stat st;
+    int num_points;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(snapshot_header))
+	return 0;
+
+    old = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (old == MAP_FAILED) return 0;
+
+    if (old->magic != SNAPSHOT_MAGIC || old->version != SNAPSHOT_VERSION ||
+		st.st_size != (off_t) SNAPSHOT_SIZE(old->num_points) ||
+		old->num_addresses > SNAPSHOT_ADDRESSES) {
+	munmap(old, st.st_size);
+	return 0;
+    }
+
+    num_points = old->num_points;
+    *points = malloc(num_points * sizeof(snapshot_point));
+    *addresses = calloc(SNAPSHOT_ADDRESSES, sizeof(snapshot_address));
+    memcpy(*points, old + 1, num_points * sizeof(snapshot_point));
+    memcpy(*addresses, (snapshot_point *) (old + 1) + num_points,
+		    old->num_addresses * sizeof(snapshot_address));
+    munmap(old, st.st_size);
+
+    qsort(*points, num_points, sizeof(snapshot_point),
+		    snapshot_point_compare);
+    return num_points;
+}
+
+/* Map the snapshot file, laid out for the current point map, and load what
+ * we can from the previous run. Called before the modbus thread starts and
+ * after libbacnet's address cache has been initialised */
+static void snapshot_open(const char *filename) {
+    snapshot_point *old_points = NULL, *old, *point;
+    snapshot_address *old_addresses = NULL;
+    struct timespec real_now, now;
+    size_t size = SNAPSHOT_SIZE(num_poll_points);
+    int fd, i, num_old, restored = 0;
+
+    if ((fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+	fprintf(stderr, "Unable to open snapshot %s: %s\n", filename,
+			strerror(errno));
+	exit(1);
+    }
+
+    num_old = snapshot_read_old(fd, &old_points, &old_addresses);
+
+    /* Start from an empty file, so a snapshot from a different point map
+     * never leaves stale records in place */
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+	fprintf(stderr, "Unable to size snapshot %s: %s\n", filename,
+			strerror(errno));
+	exit(1);
+    }
+
+    snapshot = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snapshot == MAP_FAILED) {
+	fprintf(stderr, "Unable to map snapshot %s: %s\n", filename,
+			strerror(errno));
+	exit(1);
+    }
+
+    snapshot->magic = SNAPSHOT_MAGIC;
+    snapshot->version = SNAPSHOT_VERSION;
+    snapshot->num_points = num_poll_points;
+    snapshot_points = (snapshot_point *) (snapshot + 1);
+    snapshot_addresses = (snapshot_address *) (snapshot_points +
+		    num_poll_points);
+
+    clock_gettime(CLOCK_REALTIME, &real_now);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < num_poll_points; i++) {
+	point = &snapshot_points[i];
+	point->device = bridge_devices[poll_points[i].device].instance;
+	point->instance = poll_points[i].instance;
+
+	if (!num_old) continue;
+	old = bsearch(point, old_points, num_old, sizeof(snapshot_point),
+			snapshot_point_compare);
+	if (!old || !old->valid) continue;
+	*point = *old;
+
+	/* Carry the sample's age over to the monotonic clock */
+	ai_samples[i].value = old->value;
+	ai_samples[i].rtt_ms = old->rtt_ms;
+	ai_samples[i].time.tv_sec = now.tv_sec -
+		(real_now.tv_sec - old->time.tv_sec);
+	ai_samples[i].time.tv_nsec = now.tv_nsec -
+		(real_now.tv_nsec - old->time.tv_nsec);
+	while (ai_samples[i].time.tv_nsec < 0) {
+	    ai_samples[i].time.tv_sec--;
+	    ai_samples[i].time.tv_nsec += 1000000000L;
+	}
+	while (ai_samples[i].time.tv_nsec >= 1000000000L) {
+	    ai_samples[i].time.tv_sec++;
+	    ai_samples[i].time.tv_nsec -= 1000000000L;
+	}
+	ai_samples[i].restored = 1;
+	ai_present_values[i] = old->value;
+	restored++;
+    }
+
+    /* Bindings learnt from I-Am replies in the previous run */
+    for (i = 0; old_addresses && i < SNAPSHOT_ADDRESSES; i++) {
+	if (!old_addresses[i].max_apdu) break;
+	bacnet_address_add(old_addresses[i].device,
+			old_addresses[i].max_apdu, &old_addresses[i].address);
+	snapshot_addresses[i] = old_addresses[i];
+    }
+    snapshot->num_addresses = i;
+
+    printf("Restored %i of %i points and %i addresses from %s\n",
+		    restored, num_poll_points, i, filename);
+
+    free(old_points);
+    free(old_addresses);
+}
+
+/* Called by the modbus thread with queue_lock held */
+static void snapshot_update(int slot, const ai_sample *sample,
+			const struct timespec *real_now) {
+    snapshot_point *point;
+
+    if (!snapshot) return;
+
+    point = &snapshot_points[slot];
+    point->value = sample->value;
+    point->rtt_ms = sample->rtt_ms;
+    point->time = *real_now;
+    point->valid = 1;
+}
+
+/* The address cache changes rarely, so it's copied to the snapshot once a
+ * minute */
+static void snapshot_save_addresses(void) {
+    snapshot_address *entry;
+    unsigned max_apdu;
+    int i, n = 0;
+
+    if (!snapshot) return;
+
+    for (i = 0; i < SNAPSHOT_ADDRESSES; i++) {
+	entry = &snapshot_addresses[n];
+	if (!bacnet_address_get_by_index(i, &entry->device, &max_apdu,
+				&entry->address))
+	    continue;
+	entry->max_apdu = max_apdu;
+	n++;
+    }
+    memset(&snapshot_addresses[n], 0,
+		    (SNAPSHOT_ADDRESSES - n) * sizeof(snapshot_address));
+    snapshot->num_addresses = n;
+}
+
+/* Called with queue_lock held */
+static int ai_stale(int slot, const struct timespec *now) {
+    struct timespec fresh_until = ai_samples[slot].time;
+
+    if (ai_samples[slot].restored) return 1;
+    if (!fresh_until.tv_sec && !fresh_until.tv_nsec) return 1;
+
+    timespec_add_ms(&fresh_until,
+		    poll_groups[poll_points[slot].group].interval_ms +
+		    MB_RESPONSE_TIMEOUT_MS);
+    return timespec_before(&fresh_until, now);
+}
+
+/* Queue a new sample of the point and update its latest value and COV
+ * state. Called with queue_lock held. Returns true if the BACnet thread
+ * needs waking to notify COV subscribers */
+static int poll_deliver_point(const poll_point *point, uint16_t value,
+			const struct timespec *now, float rtt_ms,
+			const struct timespec *real_now) {
+    int slot = point - poll_points;
+    ai_sample *sample = &ai_samples[slot];
+    ai_cov *cov = &ai_covs[slot];
+
+    queue_put(&queues[slot], value, rt_timing ? timespec_ns(now) : 0);
+
+    sample->value = value;
+    sample->time = *now;
+    sample->rtt_ms = rtt_ms;
+    sample->restored = 0;
+    snapshot_update(slot, sample, real_now);
+
+    if (cov->changed || (!cov->stale &&
+		fabsf(sample->value - cov->reported) < point->cov_increment))
+	return 0;
+
+    cov->changed = 1;
+    if (cov_event_pending) return 0;
+    cov_event_pending = 1;
+    return 1;
+}
+
+static void poll_cov_signal(void) {
+    uint64_t event = 1;
+
+    if (write(cov_event_fd, &event, sizeof(event)) < 0)
+	fprintf(stderr, "Unable to signal COV event: %s\n", strerror(errno));
+}
+
+static void poll_deliver(poll_request *request, uint8_t *data,
+			const struct timespec *now, float rtt_ms) {
+    const poll_point *point;
+    struct timespec real_now;
+    uint16_t value;
+    int i, offset, notify = 0;
+
+    if (snapshot) clock_gettime(CLOCK_REALTIME, &real_now);
+
+    pthread_mutex_lock(&queue_lock);
+    for (i = 0; i < request->num_points; i++) {
+	point = request->points[i];
+	offset = (point->reg - request->start) * 2;
+	value = (data[offset] << 8) | data[offset + 1];
+	notify |= poll_deliver_point(point, value, now, rtt_ms, &real_now);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    /* Wake the BACnet thread to notify COV subscribers */
+    if (notify) poll_cov_signal();
+}
+
+/* A latest only queue never holds QUEUE_LOW_WATER samples, so it's only low
+ * once it's empty. Called with queue_lock held */
+static int queue_low(sample_queue *queue) {
+    unsigned low_water = QUEUE_LOW_WATER;
+
+    if (low_water > queue_limit(queue)) low_water = queue_limit(queue);
+    return queue_depth(queue) < low_water;
+}
+
+/* Called with queue_lock held */
+static int poll_in_demand(poll_request *request, const struct timespec *now) {
+    struct timespec until;
+    int i, slot;
+
+    if (!poll_adaptive) return 1;
+
+    for (i = 0; i < request->num_points; i++) {
+	slot = request->points[i] - poll_points;
+	if (queue_low(&queues[slot])) return 1;
+
+	until = poll_demands[slot].last;
+	if (!until.tv_sec && !until.tv_nsec) continue;
+	timespec_add_ms(&until, POLL_DEMAND_MS);
+	if (timespec_before(now, &until)) return 1;
+    }
+    return 0;
+}
+
+/* Called with queue_lock held */
+static void poll_set_idle(poll_request *request, int idle) {
+    int i;
+
+    request->idle = idle;
+    for (i = 0; i < request->num_points; i++)
+	poll_demands[request->points[i] - poll_points].idle = idle;
+}
+
+/* Schedule the next poll of request. If we have fallen behind, skip the
+ * missed polls rather than bursting to catch up */
+static void poll_reschedule(poll_request *request, struct timespec *now) {
+    unsigned interval;
+
+    pthread_mutex_lock(&queue_lock);
+    poll_set_idle(request, !poll_in_demand(request, now));
+    pthread_mutex_unlock(&queue_lock);
+
+    interval = request->idle ? POLL_IDLE_INTERVAL_MS :
+	    poll_groups[request->group].interval_ms;
+    do {
+	timespec_add_ms(&request->due, interval);
+    } while (timespec_before(&request->due, now));
+}
+
+/* Poll idle requests straight away once they are in demand again */
+static void poll_wake(struct timespec *now) {
+    poll_request *request;
+    uint64_t count;
+    int i;
+
+    if (read(poll_wake_fd, &count, sizeof(count)) != sizeof(count)) return;
+
+    pthread_mutex_lock(&queue_lock);
+    for (i = 0; i < num_poll_requests; i++) {
+	request = &poll_requests[i];
+	if (!request->idle || !poll_in_demand(request, now)) continue;
+
+	poll_set_idle(request, 0);
+	if (timespec_before(now, &request->due)) request->due = *now;
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* Record a read of the point in slot. Called by the BACnet thread with
+ * queue_lock held. Returns true if the modbus thread needs waking */
+static int poll_demand_locked(int slot, const struct timespec *now) {
+    poll_demand *demand = &poll_demands[slot];
+
+    demand->last = *now;
+    if (!demand->idle) return 0;
+
+    /* Only wake the modbus thread once */
+    demand->idle = 0;
+    return 1;
+}
+
+static void poll_wake_signal(void) {
+    uint64_t event = 1;
+
+    if (write(poll_wake_fd, &event, sizeof(event)) < 0)
+	fprintf(stderr, "Unable to wake modbus thread: %s\n",
+			strerror(errno));
+}
+
+static int mb_resolve(mb_server *server) {
+    struct addrinfo hints, *result;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rc = getaddrinfo(server->host, NULL, &hints, &result))) {
+	fprintf(stderr, "Unable to resolve Modbus server %s: %s\n",
+			server->host, gai_strerror(rc));
+	return -1;
+    }
+
+    memcpy(&server->addr, result->ai_addr, sizeof(server->addr));
+    server->addr.sin_port = htons(server->port);
+    freeaddrinfo(result);
+    return 0;
+}
+
+static void mb_set_events(mb_server *server, uint32_t events, int op) {
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = server;
+    epoll_ctl(mb_epoll_fd, op, server->fd, &event);
+}
+
+static void mb_disconnect(mb_server *server, struct timespec *now,
+			const char *reason) {
+    int i;
+
+    if (server->state != MB_DISCONNECTED) {
+	fprintf(stderr, "Modbus server %s:%i: %s\n",
+			server->host, server->port, reason);
+	close(server->fd);
+	server->fd = -1;
+	server->reconnects++;
+	diag_add(reconnects, 1);
+    }
+
+    /* Requests that were in flight are simply polled again when next due */
+    for (i = 0; i < MB_WINDOW; i++) {
+	if (server->window[i].request)
+	    server->window[i].request->in_flight = 0;
+	server->window[i].request = NULL;
+    }
+    server->in_flight = 0;
+    server->rx_len = 0;
+    server->tx_len = 0;
+
+    server->state = MB_DISCONNECTED;
+    server->deadline = *now;
+    timespec_add_ms(&server->deadline, server->backoff_ms);
+
+    server->backoff_ms *= 2;
+    if (server->backoff_ms > MB_BACKOFF_MAX_MS)
+	server->backoff_ms = MB_BACKOFF_MAX_MS;
+}
+
+static void mb_connect(mb_server *server, struct timespec *now) {
+    server->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server->fd < 0) {
+	server->state = MB_DISCONNECTED;
+	mb_disconnect(server, now, strerror(errno));
+	return;
+    }
+
+    server->state = MB_CONNECTING;
+    server->deadline = *now;
+    timespec_add_ms(&server->deadline, MB_RESPONSE_TIMEOUT_MS);
+
+    if (connect(server->fd, (struct sockaddr *) &server->addr,
+			    sizeof(server->addr)) < 0 &&
+		errno != EINPROGRESS) {
+	mb_disconnect(server, now, strerror(errno));
+	return;
+    }
+
+    /* Writable once the connection completes */
+    mb_set_events(server, EPOLLIN | EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+static void mb_connected(mb_server *server, struct timespec *now) {
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    getsockopt(server->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+	mb_disconnect(server, now, strerror(err));
+	return;
+    }
+
+    fprintf(stderr, "Modbus server %s:%i: connected\n",
+		    server->host, server->port);
+    server->state = MB_CONNECTED;
+    mb_set_events(server, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+static void mb_flush(mb_server *server, struct timespec *now) {
+    ssize_t bytes;
+
+    while (server->tx_len) {
+	bytes = write(server->fd, server->tx_buf, server->tx_len);
+	if (bytes < 0) {
+	    if (errno == EAGAIN) break;
+	    mb_disconnect(server, now, strerror(errno));
+	    return;
+	}
+	server->tx_len -= bytes;
+	memmove(server->tx_buf, server->tx_buf + bytes, server->tx_len);
+    }
+
+    mb_set_events(server,
+		    server->tx_len ? EPOLLIN | EPOLLOUT : EPOLLIN,
+		    EPOLL_CTL_MOD);
+}
+
+static void mb_send(mb_server *server, poll_request *request,
+			struct timespec *now) {
+    mb_transaction *transaction = NULL;
+    uint8_t *frame;
+    int i;
+
+    for (i = 0; i < MB_WINDOW; i++) {
+	if (!server->window[i].request) {
+	    transaction = &server->window[i];
+	    break;
+	}
+    }
+    if (!transaction) return;
+
+    transaction->request = request;
+    transaction->tid = server->next_tid++;
+    transaction->sent = *now;
+    transaction->deadline = *now;
+    timespec_add_ms(&transaction->deadline, MB_RESPONSE_TIMEOUT_MS);
+    server->in_flight++;
+    request->in_flight = 1;
+
+    /* MBAP header followed by a Read Holding Registers PDU */
+    frame = server->tx_buf + server->tx_len;
+    frame[0] = transaction->tid >> 8;
+    frame[1] = transaction->tid & 0xFF;
+    frame[2] = 0;
+    frame[3] = 0;
+    frame[4] = 0;
+    frame[5] = 6;
+    frame[6] = MB_UNIT_ID;
+    frame[7] = MODBUS_FC_READ_HOLDING_REGISTERS;
+    frame[8] = request->start >> 8;
+    frame[9] = request->start & 0xFF;
+    frame[10] = request->count >> 8;
+    frame[11] = request->count & 0xFF;
+    server->tx_len += MB_REQUEST_LENGTH;
+
+    mb_flush(server, now);
+}
+
+/* Handle one complete response ADU. Returns -1 if the stream is corrupt */
+static int mb_response(mb_server *server, uint8_t *adu, size_t len,
+			struct timespec *now) {
+    mb_transaction *transaction = NULL;
+    poll_request *request;
+    uint16_t tid;
+    float rtt_ms;
+    int i;
+
+    /* The MBAP protocol id is always 0 for Modbus */
+    if (adu[2] || adu[3]) return -1;
+
+    tid = (adu[0] << 8) | adu[1];
+    for (i = 0; i < MB_WINDOW; i++) {
+	if (server->window[i].request && server->window[i].tid == tid) {
+	    transaction = &server->window[i];
+	    break;
+	}
+    }
+
+    /* Late response to a transaction we have already given up on */
+    if (!transaction) return 0;
+
+    request = transaction->request;
+    transaction->request = NULL;
+    request->in_flight = 0;
+    server->in_flight--;
+
+    if (len < 9) return -1;
+
+    /* Dropped, and polled again when next due */
+    if (adu[6] != MB_UNIT_ID) {
+	fprintf(stderr, "Modbus server %s:%i: unit %i replied reading %i+%i\n",
+			server->host, server->port, adu[6],
+			request->start, request->count);
+	return 0;
+    }
+
+    if (adu[7] & 0x80) {
+	fprintf(stderr, "Modbus server %s:%i: exception %i reading %i+%i\n",
+			server->host, server->port, adu[8],
+			request->start, request->count);
+	return 0;
+    }
+
+    if (adu[7] != MODBUS_FC_READ_HOLDING_REGISTERS ||
+		adu[8] != request->count * 2 || len < 9 + adu[8])
+	return -1;
+
+    server->backoff_ms = MB_BACKOFF_MIN_MS;
+    rtt_ms = timespec_ms_since(&transaction->sent, now);
+    diag_poll_rtt(rtt_ms);
+    poll_deliver(request, &adu[9], now, rtt_ms);
+    return 0;
+}
+
+static void mb_receive(mb_server *server, struct timespec *now) {
+    ssize_t bytes;
+    size_t adu_len;
+
+    bytes = read(server->fd, server->rx_buf + server->rx_len,
+		    sizeof(server->rx_buf) - server->rx_len);
+    if (bytes <= 0) {
+	if (bytes < 0 && errno == EAGAIN) return;
+	mb_disconnect(server, now,
+			bytes ? strerror(errno) : "connection closed");
+	return;
+    }
+    server->rx_len += bytes;
+
+    /* Consume every complete ADU in the buffer */
+    while (server->rx_len >= 6) {
+	adu_len = 6 + ((server->rx_buf[4] << 8) | server->rx_buf[5]);
+	if (adu_len > sizeof(server->rx_buf)) {
+	    mb_disconnect(server, now, "invalid MBAP length");
+	    return;
+	}
+	if (server->rx_len < adu_len) break;
+
+	if (mb_response(server, server->rx_buf, adu_len, now) < 0) {
+	    mb_disconnect(server, now, "invalid response");
+	    return;
+	}
+
+	server->rx_len -= adu_len;
+	memmove(server->rx_buf, server->rx_buf + adu_len, server->rx_len);
+    }
+}
+
+/* Connect servers whose backoff has expired and time out stalled
+ * connections and transactions */
+static void mb_service_timers(struct timespec *now) {
+    mb_server *server;
+    int i, j;
+
+    for (i = 0; i < num_mb_servers; i++) {
+	server = &mb_servers[i];
+	if (server->state == MB_UNRESOLVED || server->state == MB_SHM)
+	    continue;
+
+	if (server->state == MB_DISCONNECTED) {
+	    if (!timespec_before(now, &server->deadline))
+		mb_connect(server, now);
+	    continue;
+	}
+
+	if (server->state == MB_CONNECTING) {
+	    if (!timespec_before(now, &server->deadline))
+		mb_disconnect(server, now, "connection timed out");
+	    continue;
+	}
+
+	for (j = 0; j < MB_WINDOW; j++) {
+	    if (server->window[j].request &&
+		    !timespec_before(now, &server->window[j].deadline)) {
+		mb_disconnect(server, now, "response timed out");
+		break;
+	    }
+	}
+    }
+}
+
+/* Send every request that is due, as far as each server's window allows */
+static void poll_dispatch(struct timespec *now) {
+    poll_request *request;
+    mb_server *server;
+    int i;
+
+    for (i = 0; i < num_poll_requests; i++) {
+	request = &poll_requests[i];
+	if (request->in_flight || timespec_before(now, &request->due))
+	    continue;
+
+	server = &mb_servers[request->server];
+	if (server->state == MB_SHM) continue;
+	if (server->state != MB_CONNECTED) {
+	    /* Nothing to poll until the server comes back */
+	    poll_reschedule(request, now);
+	    continue;
+	}
+	if (server->in_flight >= MB_WINDOW) continue;
+
+	mb_send(server, request, now);
+	poll_reschedule(request, now);
+    }
+}
+
+/* Time until the modbus thread next has work to do, in ms. Requests held up
+ * by a full window are woken by the response that frees a slot */
+static int poll_next_timeout(struct timespec *now) {
+    struct timespec *next = NULL;
+    poll_request *request;
+    mb_server *server;
+    long timeout;
+    int i, j;
+
+    for (i = 0; i < num_poll_requests; i++) {
+	request = &poll_requests[i];
+	server = &mb_servers[request->server];
+	if (request->in_flight || server->state == MB_SHM) continue;
+	if (server->state == MB_CONNECTED && server->in_flight >= MB_WINDOW)
+	    continue;
+	if (!next || timespec_before(&request->due, next))
+	    next = &request->due;
+    }
+
+    for (i = 0; i < num_mb_servers; i++) {
+	server = &mb_servers[i];
+	if (server->state == MB_UNRESOLVED || server->state == MB_SHM)
+	    continue;
+
+	if (server->state != MB_CONNECTED) {
+	    if (!next || timespec_before(&server->deadline, next))
+		next = &server->deadline;
+	    continue;
+	}
+	for (j = 0; j < MB_WINDOW; j++) {
+	    if (server->window[j].request && (!next ||
+		    timespec_before(&server->window[j].deadline, next)))
+		next = &server->window[j].deadline;
+	}
+    }
+
+    if (!next) return -1;
+    timeout = timespec_ms_until(next, now);
+    return timeout < 0 ? 0 : timeout;
+}
+
+/* Shared memory transport. A server whose host is "shm" is the register region
+ * that modbus_server -s publishes on this host. The shm thread reads its
+ * requests straight from the region each time modbus_server writes to it,
+ * with no Modbus framing and no system calls, and sleeps on the region's
+ * futex in between. A point gets a new sample each time its register is
+ * written. Poll intervals only determine when its points are stale. The
+ * poll round trip time of a sample is its handoff latency: the time from
+ * the write of its register to delivery */
+#define SHM_WAIT_MS		    1000
+
+static void shm_check_requests(shm_regs *shm) {
+    poll_request *request;
+    int i;
+
+    for (i = 0; i < num_poll_requests; i++) {
+	request = &poll_requests[i];
+	if (mb_servers[request->server].shm &&
+		request->start + request->count > shm->header->num_regs)
+	    fprintf(stderr, "Registers %i+%i are not in %s\n",
+			    request->start, request->count, SHM_REGS_PATH);
+    }
+}
 
+static void *shm_poll(void *arg) {
+    uint16_t regs[MODBUS_MAX_READ_REGISTERS];
+    uint64_t published_ns[MODBUS_MAX_READ_REGISTERS], now_ns;
+    uint64_t *versions;
+    shm_regs *shm = NULL;
+    poll_request *request;
+    const poll_point *point;
+    struct timespec now, real_now;
+    time_t checked = 0;
+    uint32_t changes;
+    float rtt_ms;
+    int i, j, offset, slot, locked, notify;
+
+    rt_thread("shm", RT_SHM_CPU);
+
+    /* The published time of the write each point's sample was last taken
+     * from. Only accessed from this thread */
+    if (!(versions = calloc(num_poll_points, sizeof(uint64_t)))) {
+	fprintf(stderr, "Error allocating shm versions\n");
+	exit(1);
+    }
+
+    while (1) {
+	/* Wait for modbus_server, and follow it when it restarts. Checked
+	 * once a second, as it costs a system call */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (shm && now.tv_sec != checked) {
+	    checked = now.tv_sec;
+	    if (shm_regs_unlinked(shm)) {
+		shm_regs_close(shm);
+		shm = NULL;
+	    }
+	}
+	if (!shm) {
+	    if (!(shm = shm_regs_open(SHM_REGS_PATH))) {
+		sleep(1);
+		continue;
+	    }
+	    shm_check_requests(shm);
+	}
+
+	changes = shm_regs_changes(shm);
+	locked = notify = 0;
+
+	for (i = 0; i < num_poll_requests; i++) {
+	    request = &poll_requests[i];
+	    if (!mb_servers[request->server].shm ||
+		    shm_regs_read(shm, request->start, request->count, regs,
+				    published_ns) < 0)
+		continue;
+
+	    /* A write of one device's registers leaves the others in the
+	     * request alone, so only the points whose registers have been
+	     * written since are delivered */
+	    for (j = 0; j < request->num_points; j++) {
+		point = request->points[j];
+		slot = point - poll_points;
+		offset = point->reg - request->start;
+		if (!published_ns[offset] ||
+			published_ns[offset] == versions[slot])
+		    continue;
+		versions[slot] = published_ns[offset];
+
+		if (!locked) {
+		    clock_gettime(CLOCK_MONOTONIC, &now);
+		    if (snapshot) clock_gettime(CLOCK_REALTIME, &real_now);
+		    now_ns = timespec_ns(&now);
+		    pthread_mutex_lock(&queue_lock);
+		    locked = 1;
+		}
+
+		rtt_ms = now_ns > published_ns[offset] ?
+			(now_ns - published_ns[offset]) / 1000000.0 : 0;
+		diag_poll_rtt(rtt_ms);
+		notify |= poll_deliver_point(point, regs[offset], &now,
+				rtt_ms, &real_now);
+	    }
+	}
 
+	if (locked) pthread_mutex_unlock(&queue_lock);
+	if (notify) poll_cov_signal();
+
+	shm_regs_wait(shm, changes, SHM_WAIT_MS);
+    }
 
- // LINKED LIST FOR OBJECT
-typedef struct s_word_object word_object;
-struct s_word_object {
-    char *word;
-        word_object *next;
-	};
+    return arg;
+}
 
+static void *modbus(void *arg) {
+    struct epoll_event events[MB_MAX_EVENTS], event;
+    struct timespec now;
+    mb_server *server;
+    int i, n;
 
-// /* NEED list_head: Shared between two threads, must be accessed with list_lock */
+    if (!num_poll_requests) return arg;
 
-static word_object *list_heads[NUM_LISTS];
-static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t list_data_ready = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t list_data_flush = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+    rt_thread("modbus", RT_MODBUS_CPU);
 
+    if ((mb_epoll_fd = epoll_create1(0)) < 0) {
+	fprintf(stderr, "Unable to create epoll instance: %s\n",
+			strerror(errno));
+	return arg;
+    }
 
-// Added, link lists and headers plus modbus below
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < num_mb_servers; i++) {
+	server = &mb_servers[i];
+	server->fd = -1;
+	server->state = MB_DISCONNECTED;
+	server->deadline = now;
+	server->backoff_ms = MB_BACKOFF_MIN_MS;
 
-//===================================================
-// ----------------LINKED LISTS --------------------
-//===================================================
+	if (server->shm) server->state = MB_SHM;
+	else if (mb_resolve(server) < 0) server->state = MB_UNRESOLVED;
+    }
 
+    /* A NULL pointer tags the wake event, servers are tagged with
+     * themselves */
+    if (poll_wake_fd >= 0) {
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(mb_epoll_fd, EPOLL_CTL_ADD, poll_wake_fd, &event) < 0)
+	    fprintf(stderr, "Unable to add modbus wake event: %s\n",
+			    strerror(errno));
+    }
 
-//ADD ME Retrieve the first object in the linked list. Note that this function must
-   // be called with list_lock held */
+    while (1) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	mb_service_timers(&now);
+	poll_dispatch(&now);
+
+	n = epoll_wait(mb_epoll_fd, events, MB_MAX_EVENTS,
+			poll_next_timeout(&now));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < n; i++) {
+	    server = events[i].data.ptr;
+	    if (!server) {
+		poll_wake(&now);
+		continue;
+	    }
 
-static word_object *list_get_first(word_object **list_heads) {
-    word_object *first_object;
+	    /* Closed while handling an earlier event */
+	    if (server->state == MB_DISCONNECTED) continue;
 
-        first_object = *list_heads;
-	*list_heads = (*list_heads)->next;
+	    if (server->state == MB_CONNECTING) {
+		mb_connected(server, &now);
+		continue;
+	    }
+	    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+		mb_disconnect(server, &now, "connection error");
+		continue;
+	    }
+	    if (events[i].events & EPOLLOUT)
+		mb_flush(server, &now);
+	    if (server->state == MB_CONNECTED &&
+		    (events[i].events & EPOLLIN))
+		mb_receive(server, &now);
+	}
+    }
 
-	return first_object;
+    return arg;
 }
 
 
-/* NEED Add object to list */
-static void add_to_list(word_object **list_head, char *word) {
-    word_object *last_object, *tmp_object;
-        char *tmp_string;
 
-/* Do all memory allocation outside of locking - strdup() and malloc() can block */
-    tmp_object = malloc(sizeof(word_object));
-    tmp_string = strdup(word);
+//==================================================================
+//------------ FINISH MODBUS HERE--------------------------------
+//===================================================================
 
+// =================================================================
+//------------------------BACNET------------------------------------
+//===================================================================
 
-/* Set up tmp_object outside of locking */
-    tmp_object->word = tmp_string;
-    tmp_object->next = NULL;
 
-    pthread_mutex_lock(&list_lock);
+/* Analog Input objects are implemented here rather than by libbacnet, which
+ * is built with a fixed maximum number of instances. Objects are served
+ * straight from the point table: an instance number is looked up in the
+ * current device's hash table of its slots, and an object index is an offset
+ * into its range of slots. */
+
+/* Proprietary Analog Input properties, REAL milliseconds unless noted */
+#define AI_PROP_SAMPLE_AGE	    512	    /* Since the last Modbus read */
+#define AI_PROP_POLL_RTT	    513	    /* Of the poll that read it */
+#define AI_PROP_QUEUE_DEPTH	    514	    /* Samples queued, UNSIGNED */
+
+/* Present_Value is the next queued sample, or with -l the latest one */
+static int ai_latest_value;
+
+static const int ai_properties_required[] = {
+    bacnet_PROP_OBJECT_IDENTIFIER,
+    bacnet_PROP_OBJECT_NAME,
+    bacnet_PROP_OBJECT_TYPE,
+    bacnet_PROP_PRESENT_VALUE,
+    bacnet_PROP_STATUS_FLAGS,
+    bacnet_PROP_EVENT_STATE,
+    bacnet_PROP_OUT_OF_SERVICE,
+    bacnet_PROP_UNITS,
+    -1
+};
 
-     if (*list_head == NULL) {
-     /* The list is empty, just place our tmp_object at the head */
-     *list_head = tmp_object;
-     }
-     else{
-     /*Iterate through the linked list to find the last object */
-     last_object = *list_head;
+static const int ai_properties_optional[] = {
+    bacnet_PROP_COV_INCREMENT,
+    bacnet_PROP_RELIABILITY,
+    -1
+};
+static const int ai_properties_proprietary[] = {
+    AI_PROP_SAMPLE_AGE,
+    AI_PROP_POLL_RTT,
+    AI_PROP_QUEUE_DEPTH,
+    -1
+};
+
+static int ai_slot(uint32_t instance) {
+    unsigned mask, entry;
+    int slot;
+
+    if (!current_device->ai_hash) return -1;
+
+    mask = (1U << current_device->ai_hash_bits) - 1;
+    entry = ai_hash(current_device, instance);
+    while ((slot = current_device->ai_hash[entry]) != AI_HASH_EMPTY) {
+	if (poll_points[slot].instance == instance) return slot;
+	entry = (entry + 1) & mask;
+    }
+    return -1;
+}
+
+static unsigned ai_count(void) {
+    return current_device->num_points;
+}
+
+static uint32_t ai_index_to_instance(unsigned index) {
+    if (index >= current_device->num_points) return BACNET_MAX_INSTANCE;
+    return poll_points[current_device->first_slot + index].instance;
+}
+
+static bool ai_valid_instance(uint32_t instance) {
+    return ai_slot(instance) >= 0;
+}
+
+static bool ai_object_name(uint32_t instance,
+			BACNET_CHARACTER_STRING *object_name) {
+    char text[32];
+
+    if (!ai_valid_instance(instance)) return false;
+
+    snprintf(text, sizeof(text), "ANALOG INPUT %u", instance);
+    return bacnet_characterstring_init_ansi(object_name, text);
+}
+
+static void ai_property_lists(const int **required, const int **optional,
+			const int **proprietary) {
+    if (required) *required = ai_properties_required;
+    if (optional) *optional = ai_properties_optional;
+    if (proprietary) *proprietary = ai_properties_proprietary;
+}
+
+/* A stale point is reported as a fault */
+static void ai_status_flags(BACNET_BIT_STRING *bit_string, bool stale) {
+    bacnet_bitstring_init(bit_string);
+    bacnet_bitstring_set_bit(bit_string, STATUS_FLAG_IN_ALARM, false);
+    bacnet_bitstring_set_bit(bit_string, STATUS_FLAG_FAULT, stale);
+    bacnet_bitstring_set_bit(bit_string, STATUS_FLAG_OVERRIDDEN, false);
+    bacnet_bitstring_set_bit(bit_string, STATUS_FLAG_OUT_OF_SERVICE, false);
+}
+
+static int ai_read_property(BACNET_READ_PROPERTY_DATA *rpdata) {
+    BACNET_BIT_STRING bit_string;
+    BACNET_CHARACTER_STRING char_string;
+    uint8_t *apdu = rpdata->application_data;
+    struct timespec now;
+    ai_sample sample;
+    uint16_t value;
+    uint64_t read_ns = 0;
+    unsigned depth;
+    int slot, have_data, stale, wake;
+
+    if (!apdu || !rpdata->application_data_len) return 0;
+
+    if ((slot = ai_slot(rpdata->object_instance)) < 0) {
+	rpdata->error_class = ERROR_CLASS_OBJECT;
+	rpdata->error_code = ERROR_CODE_UNKNOWN_OBJECT;
+	return BACNET_STATUS_ERROR;
+    }
+
+    /* None of the Analog Input properties are arrays */
+    if (rpdata->array_index != BACNET_ARRAY_ALL) {
+	rpdata->error_class = ERROR_CLASS_PROPERTY;
+	rpdata->error_code = ERROR_CODE_PROPERTY_IS_NOT_AN_ARRAY;
+	return BACNET_STATUS_ERROR;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&queue_lock);
+    sample = ai_samples[slot];
+    stale = ai_stale(slot, &now);
+    depth = queue_depth(&queues[slot]);
+    pthread_mutex_unlock(&queue_lock);
+
+    /* Cast as the proprietary properties aren't in the enumeration */
+    switch ((int) rpdata->object_property) {
+	case bacnet_PROP_OBJECT_IDENTIFIER:
+	    return bacnet_encode_application_object_id(apdu,
+			    bacnet_OBJECT_ANALOG_INPUT, rpdata->object_instance);
+
+	case bacnet_PROP_OBJECT_NAME:
+	    ai_object_name(rpdata->object_instance, &char_string);
+	    return bacnet_encode_application_character_string(apdu,
+			    &char_string);
+
+	case bacnet_PROP_OBJECT_TYPE:
+	    return bacnet_encode_application_enumerated(apdu,
+			    bacnet_OBJECT_ANALOG_INPUT);
+
+	case bacnet_PROP_PRESENT_VALUE:
+	    /* Each read consumes the sample at the head of the point's
+	     * queue. If the queue is empty, the previous Present_Value is
+	     * sent again */
+	    pthread_mutex_lock(&queue_lock);
+	    wake = poll_adaptive && poll_demand_locked(slot, &now);
+	    have_data = !ai_latest_value &&
+		    queue_get(&queues[slot], &value, &read_ns);
+	    pthread_mutex_unlock(&queue_lock);
+	    if (wake) poll_wake_signal();
+
+	    if (ai_latest_value) {
+		/* The latest sample is served until it's replaced, so this
+		 * is also its age */
+		if (rt_timing && !sample.restored)
+		    rt_latency_served(timespec_ns(&sample.time));
+		return bacnet_encode_application_real(apdu, sample.value);
+	    }
 
-     while (last_object->next) {
-     	    last_object = last_object->next;
+	    if (have_data) {
+		if (rt_timing)
+		    rt_latency_served(read_ns);
+		else
+		    printf("AI_Present_Value request for instance %u\n",
+				    rpdata->object_instance);
+		ai_present_values[slot] = value;
 	    }
+	    return bacnet_encode_application_real(apdu,
+			    ai_present_values[slot]);
+
+	case bacnet_PROP_STATUS_FLAGS:
+	    ai_status_flags(&bit_string, stale);
+	    return bacnet_encode_application_bitstring(apdu, &bit_string);
+
+	case bacnet_PROP_RELIABILITY:
+	    return bacnet_encode_application_enumerated(apdu, stale ?
+			    RELIABILITY_COMMUNICATION_FAILURE :
+			    RELIABILITY_NO_FAULT_DETECTED);
+
+	case bacnet_PROP_EVENT_STATE:
+	    return bacnet_encode_application_enumerated(apdu,
+			    EVENT_STATE_NORMAL);
+
+	case bacnet_PROP_OUT_OF_SERVICE:
+	    return bacnet_encode_application_boolean(apdu, false);
+
+	case bacnet_PROP_UNITS:
+	    return bacnet_encode_application_enumerated(apdu, UNITS_NO_UNITS);
 
-	/* Last object is now found, link in our tmp_object at the tail */
-	last_object->next = tmp_object;
-	last_object = last_object->next;
+	case bacnet_PROP_COV_INCREMENT:
+	    return bacnet_encode_application_real(apdu,
+			    poll_points[slot].cov_increment);
 
+	case AI_PROP_SAMPLE_AGE:
+	    /* Infinite if the point has never been read */
+	    return bacnet_encode_application_real(apdu,
+			    sample.time.tv_sec || sample.time.tv_nsec ?
+			    timespec_ms_since(&sample.time, &now) : INFINITY);
 
-         }
+	case AI_PROP_POLL_RTT:
+	    return bacnet_encode_application_real(apdu, sample.rtt_ms);
 
-    pthread_mutex_unlock(&list_lock);
-    pthread_cond_signal(&list_data_ready);
+	case AI_PROP_QUEUE_DEPTH:
+	    return bacnet_encode_application_unsigned(apdu, depth);
+
+	default:
+	    rpdata->error_class = ERROR_CLASS_PROPERTY;
+	    rpdata->error_code = ERROR_CODE_UNKNOWN_PROPERTY;
+	    return BACNET_STATUS_ERROR;
+    }
 }
 
+/* COV subscriptions are served by libbacnet's COV handlers, which poll these
+ * functions for each subscribed object */
+static bool ai_change_of_value(uint32_t instance) {
+    struct timespec now;
+    int slot, changed, wake = 0;
 
+    if ((slot = ai_slot(instance)) < 0) return false;
 
+    /* Called for every subscribed object on each pass of the COV state
+     * machine, at least once a second, so a subscription is demand */
+    if (poll_adaptive) clock_gettime(CLOCK_MONOTONIC, &now);
 
+    pthread_mutex_lock(&queue_lock);
+    changed = ai_covs[slot].changed;
+    if (poll_adaptive) wake = poll_demand_locked(slot, &now);
+    pthread_mutex_unlock(&queue_lock);
+    if (wake) poll_wake_signal();
 
+    return changed;
+}
 
+static void ai_change_of_value_clear(uint32_t instance) {
+    struct timespec now;
+    int slot;
 
+    if ((slot = ai_slot(instance)) < 0) return;
 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&queue_lock);
+    ai_covs[slot].reported = ai_samples[slot].value;
+    ai_covs[slot].stale = ai_stale(slot, &now);
+    ai_covs[slot].changed = 0;
+    pthread_mutex_unlock(&queue_lock);
+}
 
+/* Flag points that have gone stale since subscribers were last notified */
+static void ai_check_stale(void) {
+    struct timespec now;
+    int i;
 
-//-=====================================================================
-//----------------ADD MODBUS PROGRAM HERE--------------------------
-//======================================================================
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&queue_lock);
+    for (i = 0; i < num_poll_points; i++) {
+	if (ai_covs[i].changed || ai_covs[i].stale) continue;
+	if (ai_stale(i, &now)) ai_covs[i].changed = 1;
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
 
+/* Fill in the Present_Value and Status_Flags entries of a COV notification.
+ * Notifications carry the most recent sample rather than consuming one from
+ * the point's queue */
+static bool ai_encode_value_list(uint32_t instance,
+			BACNET_PROPERTY_VALUE *value_list) {
+    struct timespec now;
+    int slot, stale;
+
+    if ((slot = ai_slot(instance)) < 0) return false;
+    if (!value_list || !value_list->next) return false;
+
+    value_list->propertyIdentifier = bacnet_PROP_PRESENT_VALUE;
+    value_list->propertyArrayIndex = BACNET_ARRAY_ALL;
+    value_list->value.context_specific = false;
+    value_list->value.tag = BACNET_APPLICATION_TAG_REAL;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&queue_lock);
+    value_list->value.type.Real = ai_samples[slot].value;
+    stale = ai_stale(slot, &now);
+    pthread_mutex_unlock(&queue_lock);
+    value_list->value.next = NULL;
+    value_list->priority = BACNET_NO_PRIORITY;
+
+    value_list = value_list->next;
+    value_list->propertyIdentifier = bacnet_PROP_STATUS_FLAGS;
+    value_list->propertyArrayIndex = BACNET_ARRAY_ALL;
+    value_list->value.context_specific = false;
+    value_list->value.tag = BACNET_APPLICATION_TAG_BIT_STRING;
+    ai_status_flags(&value_list->value.type.Bit_String, stale);
+    value_list->value.next = NULL;
+    value_list->priority = BACNET_NO_PRIORITY;
+
+    return true;
+}
 
-	static void *modbus(void *arg) {
-	int i;
-	int rc;
-	uint16_t tab_reg[128];
-	char sending [64];
-	modbus_t *ctx;
-
-	// Kim server is at 140.159.153.159
-	
-	
- 	ctx = modbus_new_tcp("140.159.153.159", 502);
-
-	// testing on another server if kim's is down
-//	ctx = modbus_new_tcp("140.159.119.87", 502);
-	
-	//ctx = modbus_new_tcp("127.0.0.1", 502);
-	
-	if (ctx == NULL) {
-	fprintf(stderr, "Unable to find libmodbus context\n");
-	return NULL;
-	}
+/* Analog Inputs are read only: their values come from the Modbus servers */
+static bool ai_write_property(BACNET_WRITE_PROPERTY_DATA *wp_data) {
+    wp_data->error_class = ERROR_CLASS_PROPERTY;
+    wp_data->error_code = ERROR_CODE_WRITE_ACCESS_DENIED;
+    return false;
+}
 
-	if (modbus_connect(ctx) == -1) {
-	printf("The connection failed!");
-	fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
-	modbus_free(ctx);
-	return NULL;
-   	}
-	 
-	// You can have device no 110 with two analogue instances.
-	//
-	// DEVICE ID = 12 - NUMBER OF REGISTERS = 1 - Subject to change
-	while(1) {
-	
-	rc = modbus_read_registers(ctx, 110, 2, tab_reg);
-	
-//	rc = modbus_read_registers(ctx, 12, 1, tab_reg);
-	
-	if (rc == -1) {
-	fprintf(stderr, "%s\n", modbus_strerror(errno));
-	return NULL;
- 	} 	
-
-	for (i=0; i < rc; i++) {
-	sprintf(sending,"%x", tab_reg[i]); 
-	add_to_list(&list_heads[i], sending);
-	//printf("reg[%d]=%d (0x%X)\n", i, tab_reg[i], tab_reg[i]);
-	}
-	
-	usleep (100000);
+/* Diagnostics Analog Values, served by our own device with -i. Values are
+ * recalculated by diag_update() every DIAG_PERIOD_S seconds */
+#define DIAG_POLL_RTT_AVG	    0
+#define DIAG_POLL_RTT_P99	    1
+#define DIAG_QUEUED		    2
+#define DIAG_DROPPED		    3
+#define DIAG_RECONNECTS		    4
+#define DIAG_REQUEST_RATE	    5
+#define DIAG_HANDLER_TIME	    6
+#define DIAG_NUM_VALUES		    7
+
+static const struct {
+    const char		*name;
+    BACNET_ENGINEERING_UNITS units;
+} diag_objects[DIAG_NUM_VALUES] = {
+    [DIAG_POLL_RTT_AVG] =	{"MODBUS POLL RTT AVG", UNITS_MILLISECONDS},
+    [DIAG_POLL_RTT_P99] =	{"MODBUS POLL RTT P99", UNITS_MILLISECONDS},
+    [DIAG_QUEUED] =		{"QUEUED SAMPLES", UNITS_NO_UNITS},
+    [DIAG_DROPPED] =		{"DROPPED SAMPLES", UNITS_NO_UNITS},
+    [DIAG_RECONNECTS] =		{"MODBUS RECONNECTS", UNITS_NO_UNITS},
+    [DIAG_REQUEST_RATE] =	{"READ REQUEST RATE", UNITS_PER_SECOND},
+    [DIAG_HANDLER_TIME] =	{"READ HANDLER TIME AVG", UNITS_MILLISECONDS},
+};
 
-	}
-//	modbus_close(ctx); 
-//	modbus_free(ctx);
-//	sleep(1) ;
-	return NULL;
+/* Only accessed from the BACnet thread */
+static float diag_values[DIAG_NUM_VALUES];
+
+static const int av_properties_none[] = {
+    -1
+};
+
+static void diag_update(unsigned seconds) {
+    unsigned long rtt_count, rtt_total_us, count, requests, handler_ns;
+    unsigned long p99 = 0;
+    unsigned i;
+
+    rtt_count = diag_take(rtt_count);
+    rtt_total_us = diag_take(rtt_total_us);
+    requests = diag_take(requests);
+    handler_ns = diag_take(handler_ns);
+
+    /* The bucket holding the 99th percentile, reported as its upper bound.
+     * Samples that arrive while the buckets are being taken are counted in
+     * the next period */
+    for (i = 0, count = 0; i < RTT_HISTOGRAM_BUCKETS; i++) {
+	count += diag_take(rtt_buckets[i]);
+	if (!p99 && rtt_count && count * 100 >= rtt_count * 99)
+	    p99 = rtt_histogram_bucket_us(i + 1);
+    }
+
+    diag_values[DIAG_POLL_RTT_AVG] = rtt_count ?
+	    rtt_total_us / 1000.0 / rtt_count : 0;
+    diag_values[DIAG_POLL_RTT_P99] = p99 / 1000.0;
+    diag_values[DIAG_QUEUED] = diag_read(queued);
+    diag_values[DIAG_DROPPED] = diag_read(dropped);
+    diag_values[DIAG_RECONNECTS] = diag_read(reconnects);
+    diag_values[DIAG_REQUEST_RATE] = (float) requests / seconds;
+    diag_values[DIAG_HANDLER_TIME] = requests ?
+	    handler_ns / 1000000.0 / requests : 0;
 }
 
+static unsigned av_count(void) {
+    return diag_enabled && current_device == bridge_devices ?
+	    DIAG_NUM_VALUES : 0;
+}
 
+static uint32_t av_index_to_instance(unsigned index) {
+    return index < av_count() ? index : BACNET_MAX_INSTANCE;
+}
 
-//==================================================================
-//------------ FINISH MODBUS HERE--------------------------------
-//===================================================================
+static bool av_valid_instance(uint32_t instance) {
+    return instance < av_count();
+}
 
-static void list_flush(word_object *list_head) {
-	pthread_mutex_lock(&list_lock);
-	
-	while (list_head != NULL) {
-	pthread_cond_signal(&list_data_ready);
-	pthread_cond_wait(&list_data_flush, &list_lock);
-	}
+static bool av_object_name(uint32_t instance,
+			BACNET_CHARACTER_STRING *object_name) {
+    if (!av_valid_instance(instance)) return false;
+    return bacnet_characterstring_init_ansi(object_name,
+		    diag_objects[instance].name);
+}
 
-	pthread_mutex_unlock(&list_lock);
+/* The required properties are the same as an Analog Input's */
+static void av_property_lists(const int **required, const int **optional,
+			const int **proprietary) {
+    if (required) *required = ai_properties_required;
+    if (optional) *optional = av_properties_none;
+    if (proprietary) *proprietary = av_properties_none;
 }
 
+static int av_read_property(BACNET_READ_PROPERTY_DATA *rpdata) {
+    BACNET_BIT_STRING bit_string;
+    BACNET_CHARACTER_STRING char_string;
+    uint8_t *apdu = rpdata->application_data;
+    uint32_t instance = rpdata->object_instance;
 
-// array of linked lists (week 11)
+    if (!apdu || !rpdata->application_data_len) return 0;
 
-// =================================================================
-//------------------------BACNET------------------------------------
-//===================================================================
+    if (!av_valid_instance(instance)) {
+	rpdata->error_class = ERROR_CLASS_OBJECT;
+	rpdata->error_code = ERROR_CODE_UNKNOWN_OBJECT;
+	return BACNET_STATUS_ERROR;
+    }
 
+    if (rpdata->array_index != BACNET_ARRAY_ALL) {
+	rpdata->error_class = ERROR_CLASS_PROPERTY;
+	rpdata->error_code = ERROR_CODE_PROPERTY_IS_NOT_AN_ARRAY;
+	return BACNET_STATUS_ERROR;
+    }
 
-static int Update_Analog_Input_Read_Property(
-		BACNET_READ_PROPERTY_DATA *rpdata) {
+    switch (rpdata->object_property) {
+	case bacnet_PROP_OBJECT_IDENTIFIER:
+	    return bacnet_encode_application_object_id(apdu,
+			    bacnet_OBJECT_ANALOG_VALUE, instance);
 
-	word_object *current_package; //placement variable
-	uint16_t stack[3]; //second placement variable 
+	case bacnet_PROP_OBJECT_NAME:
+	    av_object_name(instance, &char_string);
+	    return bacnet_encode_application_character_string(apdu,
+			    &char_string);
 
-    static int index;
-    int instance_no = bacnet_Analog_Input_Instance_To_Index(
-			rpdata->object_instance);
+	case bacnet_PROP_OBJECT_TYPE:
+	    return bacnet_encode_application_enumerated(apdu,
+			    bacnet_OBJECT_ANALOG_VALUE);
 
+	case bacnet_PROP_PRESENT_VALUE:
+	    return bacnet_encode_application_real(apdu,
+			    diag_values[instance]);
 
+	case bacnet_PROP_STATUS_FLAGS:
+	    ai_status_flags(&bit_string, false);
+	    return bacnet_encode_application_bitstring(apdu, &bit_string);
 
+	case bacnet_PROP_EVENT_STATE:
+	    return bacnet_encode_application_enumerated(apdu,
+			    EVENT_STATE_NORMAL);
 
-    if (rpdata->object_property != bacnet_PROP_PRESENT_VALUE) goto not_pv;
+	case bacnet_PROP_OUT_OF_SERVICE:
+	    return bacnet_encode_application_boolean(apdu, false);
 
- 	pthread_mutex_lock(&list_lock); // lock list 
+	case bacnet_PROP_UNITS:
+	    return bacnet_encode_application_enumerated(apdu,
+			    diag_objects[instance].units);
 
- 
+	default:
+	    rpdata->error_class = ERROR_CLASS_PROPERTY;
+	    rpdata->error_code = ERROR_CODE_UNKNOWN_PROPERTY;
+	    return BACNET_STATUS_ERROR;
+    }
+}
 
+/* Diagnostics are read only */
+static bool av_write_property(BACNET_WRITE_PROPERTY_DATA *wp_data) {
+    wp_data->error_class = ERROR_CLASS_PROPERTY;
+    wp_data->error_code = ERROR_CODE_WRITE_ACCESS_DENIED;
+    return false;
+}
 
+/* The Device object is libbacnet's, except that a virtual device has its own
+ * instance and name and can't be written */
+static unsigned dev_count(void) {
+    return 1;
+}
 
-    /* Update the values to be sent to the BACnet client here.
-     * The data should be read from the head of a linked list. You are required
-     * to implement this list functionality.
-     *
-     * bacnet_Analog_Input_Present_Value_Set() 
-     *     First argument: Instance No
-     *     Second argument: data to be sent
-     *
-     * Without reconfiguring libbacnet, a maximum of 4 values may be sent */
-    // --------------------  EDIT HERE ====================================
-    //
-    //
+static uint32_t dev_index_to_instance(unsigned index) {
+    return current_device->instance;
+}
 
-	
-	if (list_heads[instance_no] == NULL) { //if no objects in list bail out
-	pthread_mutex_unlock(&list_lock); // unlock list
-	goto not_pv; //bail out, go to end of function
-	}
-	current_package = list_get_first(&list_heads[instance_no]); //update current 		package with data from first of list
-	stack[instance_no] = strtol(current_package->word, NULL, 16); // convert string to long int.
-	free(current_package); // release memory saved for current package
-	pthread_mutex_unlock(&list_lock); // unlock list
-	
+static bool dev_valid_instance(uint32_t instance) {
+    return instance == current_device->instance;
+}
+
+static bool dev_object_name(uint32_t instance,
+			BACNET_CHARACTER_STRING *object_name) {
+    if (current_device == bridge_devices)
+	return bacnet_Device_Object_Name(instance, object_name);
+
+    if (!dev_valid_instance(instance)) return false;
+    return bacnet_characterstring_init_ansi(object_name, current_device->name);
+}
+
+static int dev_read_property(BACNET_READ_PROPERTY_DATA *rpdata) {
+    BACNET_CHARACTER_STRING char_string;
+    uint8_t *apdu = rpdata->application_data;
 
+    if (current_device == bridge_devices ||
+	    (rpdata->object_property != bacnet_PROP_OBJECT_IDENTIFIER &&
+	     rpdata->object_property != bacnet_PROP_OBJECT_NAME))
+	return bacnet_Device_Read_Property_Local(rpdata);
 
+    if (rpdata->array_index != BACNET_ARRAY_ALL) {
+	rpdata->error_class = ERROR_CLASS_PROPERTY;
+	rpdata->error_code = ERROR_CODE_PROPERTY_IS_NOT_AN_ARRAY;
+	return BACNET_STATUS_ERROR;
+    }
 
+    if (rpdata->object_property == bacnet_PROP_OBJECT_IDENTIFIER)
+	return bacnet_encode_application_object_id(apdu,
+			bacnet_OBJECT_DEVICE, current_device->instance);
 
-   printf("AI_Present_Value request for instance %i\n", instance_no);
+    dev_object_name(current_device->instance, &char_string);
+    return bacnet_encode_application_character_string(apdu, &char_string);
+}
 
-    bacnet_Analog_Input_Present_Value_Set(instance_no, stack[instance_no]); 
-    // bacnet client gets data and sends 
-    /* bacnet_Analog_Input_Present_Value_Set(1, test_data[index++]); */
-    /* bacnet_Analog_Input_Present_Value_Set(2, test_data[index++]); */
-    
-    if (index == NUM_TEST_DATA) index = 0;
+static bool dev_write_property(BACNET_WRITE_PROPERTY_DATA *wp_data) {
+    if (current_device == bridge_devices)
+	return bacnet_Device_Write_Property_Local(wp_data);
 
-not_pv:
-    return bacnet_Analog_Input_Read_Property(rpdata);
+    wp_data->error_class = ERROR_CLASS_PROPERTY;
+    wp_data->error_code = ERROR_CODE_WRITE_ACCESS_DENIED;
+    return false;
 }
 
 static bacnet_object_functions_t server_objects[] = {
     {bacnet_OBJECT_DEVICE,
 	    NULL,
-	    bacnet_Device_Count,
-	    bacnet_Device_Index_To_Instance,
-	    bacnet_Device_Valid_Object_Instance_Number,
-	    bacnet_Device_Object_Name,
-	    bacnet_Device_Read_Property_Local,
-	    bacnet_Device_Write_Property_Local,
+	    dev_count,
+	    dev_index_to_instance,
+	    dev_valid_instance,
+	    dev_object_name,
+	    dev_read_property,
+	    dev_write_property,
 	    bacnet_Device_Property_Lists,
 	    bacnet_DeviceGetRRInfo,
 	    NULL, /* Iterator */
@@ -317,26 +2380,42 @@ static bacnet_object_functions_t server_objects[] = {
 	    NULL  /* Intrinsic Reporting */
     },
     {bacnet_OBJECT_ANALOG_INPUT,
-            bacnet_Analog_Input_Init,
-            bacnet_Analog_Input_Count,
-            bacnet_Analog_Input_Index_To_Instance,
-            bacnet_Analog_Input_Valid_Instance,
-            bacnet_Analog_Input_Object_Name,
-            Update_Analog_Input_Read_Property,
-            bacnet_Analog_Input_Write_Property,
-            bacnet_Analog_Input_Property_Lists,
-            NULL /* ReadRangeInfo */ ,
-            NULL /* Iterator */ ,
-            bacnet_Analog_Input_Encode_Value_List,
-            bacnet_Analog_Input_Change_Of_Value,
-            bacnet_Analog_Input_Change_Of_Value_Clear,
-            bacnet_Analog_Input_Intrinsic_Reporting},
+	    NULL,
+	    ai_count,
+	    ai_index_to_instance,
+	    ai_valid_instance,
+	    ai_object_name,
+	    ai_read_property,
+	    ai_write_property,
+	    ai_property_lists,
+	    NULL, /* ReadRangeInfo */
+	    NULL, /* Iterator */
+	    ai_encode_value_list,
+	    ai_change_of_value,
+	    ai_change_of_value_clear,
+	    NULL  /* Intrinsic Reporting */
+    },
+    {bacnet_OBJECT_ANALOG_VALUE,
+	    NULL,
+	    av_count,
+	    av_index_to_instance,
+	    av_valid_instance,
+	    av_object_name,
+	    av_read_property,
+	    av_write_property,
+	    av_property_lists,
+	    NULL, /* ReadRangeInfo */
+	    NULL, /* Iterator */
+	    NULL, /* Value_Lists */
+	    NULL, /* COV */
+	    NULL, /* COV Clear */
+	    NULL  /* Intrinsic Reporting */
+    },
     {MAX_BACNET_OBJECT_TYPE}
 };
 
 static void register_with_bbmd(void) {
 #if RUN_AS_BBMD_CLIENT
-    /* Thread safety: Shares data with datalink_send_pdu */
     bacnet_bvlc_register_with_bbmd(
 	    bacnet_bip_getaddrbyname(BACNET_BBMD_ADDRESS), 
 	    htons(BACNET_BBMD_PORT),
@@ -344,69 +2423,336 @@ static void register_with_bbmd(void) {
 #endif
 }
 
-static void *minute_tick(void *arg) {
-    while (1) {
-	pthread_mutex_lock(&timer_lock);
+/* Routing to the virtual devices. Requests for a virtual device carry
+ * BACNET_VIRTUAL_NETWORK as DNET and the device's index as DADR, so dispatch
+ * is an array lookup. current_device is switched to the device while the
+ * APDU is handled, which selects its objects, and route_get_my_address()
+ * gives replies the device's network address as their source */
+static void (*route_get_my_address_direct)(BACNET_ADDRESS *my_address);
+
+/* Devices a Who-Is in the packet being handled is addressed to */
+static int who_is_first, who_is_last = 1;
+
+static void route_get_my_address(BACNET_ADDRESS *my_address) {
+    int index = current_device - bridge_devices;
 
-	/* Expire addresses once the TTL has expired */
-	bacnet_address_cache_timer(60);
+    route_get_my_address_direct(my_address);
+    if (!index) return;
 
-	/* Re-register with BBMD once BBMD TTL has expired */
-	register_with_bbmd();
+    my_address->net = BACNET_VIRTUAL_NETWORK;
+    my_address->len = 2;
+    my_address->adr[0] = index >> 8;
+    my_address->adr[1] = index & 0xFF;
+}
+
+static void route_send_i_am(bridge_device *device) {
+    BACNET_ADDRESS dest, my_address;
+    BACNET_NPDU_DATA npdu_data;
+    bridge_device *handling = current_device;
+    uint8_t *pdu = bacnet_Handler_Transmit_Buffer;
+    int len;
+
+    current_device = device;
+    bacnet_datalink_get_my_address(&my_address);
+    current_device = handling;
+
+    bacnet_datalink_get_broadcast_address(&dest);
+    bacnet_npdu_encode_npdu_data(&npdu_data, false, MESSAGE_PRIORITY_NORMAL);
+    len = bacnet_npdu_encode_pdu(pdu, &dest, &my_address, &npdu_data);
+    len += bacnet_iam_encode_apdu(pdu + len, device->instance,
+		    bacnet_MAX_APDU, SEGMENTATION_NONE,
+		    bacnet_Device_Vendor_Identifier());
+    bacnet_datalink_send_pdu(&dest, &npdu_data, pdu, len);
+}
+
+static void route_send_i_am_router(void) {
+    BACNET_ADDRESS dest;
+    BACNET_NPDU_DATA npdu_data;
+    uint8_t *pdu = bacnet_Handler_Transmit_Buffer;
+    int len;
+
+    bacnet_datalink_get_broadcast_address(&dest);
+    bacnet_npdu_encode_npdu_data(&npdu_data, false, MESSAGE_PRIORITY_NORMAL);
+    npdu_data.network_layer_message = true;
+    npdu_data.network_message_type = NETWORK_MESSAGE_I_AM_ROUTER_TO_NETWORK;
+    len = bacnet_npdu_encode_pdu(pdu, &dest, NULL, &npdu_data);
+    pdu[len++] = BACNET_VIRTUAL_NETWORK >> 8;
+    pdu[len++] = BACNET_VIRTUAL_NETWORK & 0xFF;
+    bacnet_datalink_send_pdu(&dest, &npdu_data, pdu, len);
+}
 
-	/* Update addresses for notification class recipient list 
-	 * Requred for INTRINSIC_REPORTING
-	 * bacnet_Notification_Class_find_recipient(); */
-	
-	/* Sleep for 1 minute */
-	pthread_mutex_unlock(&timer_lock);
-	sleep(60);
+/* Replaces libbacnet's Who-Is handler, which only knows about one device */
+static void route_who_is(uint8_t *service_request, uint16_t service_len,
+			BACNET_ADDRESS *src) {
+    int32_t low = 0, high = BACNET_MAX_INSTANCE;
+    int i;
+
+    if (service_len && bacnet_whois_decode_service_request(
+			    service_request, service_len, &low, &high) <= 0)
+	return;
+
+    for (i = who_is_first; i < who_is_last; i++) {
+	if (bridge_devices[i].instance < low ||
+		bridge_devices[i].instance > high)
+	    continue;
+	route_send_i_am(&bridge_devices[i]);
     }
-    return arg;
 }
 
-static void *second_tick(void *arg) {
-    while (1) {
-	pthread_mutex_lock(&timer_lock);
-
-	/* Invalidates stale BBMD foreign device table entries */
-	bacnet_bvlc_maintenance_timer(1);
-
-	/* Transaction state machine: Responsible for retransmissions and ack
-	 * checking for confirmed services */
-	bacnet_tsm_timer_milliseconds(1000);
-
-	/* Re-enables communications after DCC_Time_Duration_Seconds
-	 * Required for SERVICE_CONFIRMED_DEVICE_COMMUNICATION_CONTROL
-	 * bacnet_dcc_timer_seconds(1); */
-
-	/* State machine for load control object
-	 * Required for OBJECT_LOAD_CONTROL
-	 * bacnet_Load_Control_State_Machine_Handler(); */
-
-	/* Expires any COV subscribers that have finite lifetimes
-	 * Required for SERVICE_CONFIRMED_SUBSCRIBE_COV
-	 * bacnet_handler_cov_timer_seconds(1); */
-
-	/* Monitor Trend Log uLogIntervals and fetch properties
-	 * Required for OBJECT_TRENDLOG
-	 * bacnet_trend_log_timer(1); */
-	
-	/* Run [Object_Type]_Intrinsic_Reporting() for all objects in device
-	 * Required for INTRINSIC_REPORTING
-	 * bacnet_Device_local_reporting(); */
-	
-	/* Sleep for 1 second */
-	pthread_mutex_unlock(&timer_lock);
-	sleep(1);
+/* libbacnet ignores network layer messages, so answer
+ * Who-Is-Router-To-Network here */
+static void route_network_message(BACNET_NPDU_DATA *npdu_data,
+			uint8_t *data, int len) {
+    if (npdu_data->network_message_type !=
+	    NETWORK_MESSAGE_WHO_IS_ROUTER_TO_NETWORK)
+	return;
+
+    if (len >= 2 && ((data[0] << 8) | data[1]) != BACNET_VIRTUAL_NETWORK)
+	return;
+    route_send_i_am_router();
+}
+
+/* Takes the place of bacnet_npdu_handler() */
+static void route_npdu(BACNET_ADDRESS *src, uint8_t *pdu, uint16_t pdu_len) {
+    BACNET_ADDRESS dest;
+    BACNET_NPDU_DATA npdu_data;
+    int offset, index = 0;
+
+    /* Nothing to route to */
+    if (num_bridge_devices == 1) {
+	bacnet_npdu_handler(src, pdu, pdu_len);
+	return;
     }
-    return arg;
+
+    if (!pdu_len || pdu[0] != BACNET_PROTOCOL_VERSION) return;
+    offset = bacnet_npdu_decode(pdu, &dest, src, &npdu_data);
+    if (offset <= 0 || offset > pdu_len) return;
+
+    if (npdu_data.network_layer_message) {
+	route_network_message(&npdu_data, pdu + offset, pdu_len - offset);
+	return;
+    }
+
+    who_is_first = 0;
+    who_is_last = 1;
+    if (dest.net == BACNET_BROADCAST_NETWORK) {
+	who_is_last = num_bridge_devices;
+
+    } else if (dest.net == BACNET_VIRTUAL_NETWORK && !dest.len) {
+	/* Broadcast on the virtual network */
+	who_is_first = 1;
+	who_is_last = num_bridge_devices;
+
+    } else if (dest.net == BACNET_VIRTUAL_NETWORK) {
+	if (dest.len != 2) return;
+	index = (dest.adr[0] << 8) | dest.adr[1];
+	if (index < 1 || index >= num_bridge_devices) return;
+	who_is_first = index;
+	who_is_last = index + 1;
+
+    } else if (dest.net) {
+	/* Not a network we route to */
+	return;
+    }
+
+    current_device = &bridge_devices[index];
+    bacnet_apdu_handler(src, pdu + offset, pdu_len - offset);
+    current_device = bridge_devices;
+}
+
+/* Batched BACnet/IP datalink, see dgram_batch.h. A batch is open while
+ * handling received datagrams, so the replies to them are sent together.
+ * Anything sent from the timers goes through libbacnet's datalink */
+static unsigned batch_size = BACNET_BATCH_SIZE;
+
+static void batch_init(void) {
+    BACNET_ADDRESS my_address;
+
+    /* Route all sends through the link so they are counted */
+    bacnet_datalink_get_my_address(&my_address);
+    dgram_link_init(bacnet_bip_socket(), batch_size, bacnet_MAX_MPDU,
+		    BATCH_RECEIVE, &my_address, bacnet_datalink_send_pdu);
+    bacnet_datalink_send_pdu = dgram_link_send_pdu;
 }
 
 static void ms_tick(void) {
     /* Updates change of value COV subscribers.
      * Required for SERVICE_CONFIRMED_SUBSCRIBE_COV
-     * bacnet_handler_cov_task(); */
+     * The COV state machine handles one step per call: run it through a
+     * complete pass over the subscription list */
+    while (!bacnet_handler_cov_fsm());
+}
+
+static void minute_tick(unsigned minutes) {
+    /* Expire addresses once the TTL has expired */
+    bacnet_address_cache_timer(minutes * 60);
+
+    /* Re-register with BBMD once BBMD TTL has expired */
+    register_with_bbmd();
+
+    /* Report sample queue usage and BACnet/IP packet rates */
+    queue_report();
+    dgram_link_report(minutes * 60);
+    rt_report();
+
+    /* Keep the warm start snapshot's address cache up to date */
+    snapshot_save_addresses();
+
+    /* Update addresses for notification class recipient list 
+     * Requred for INTRINSIC_REPORTING
+     * bacnet_Notification_Class_find_recipient(); */
+}
+
+static void second_tick(unsigned seconds) {
+    static unsigned diag_seconds;
+
+    /* Invalidates stale BBMD foreign device table entries */
+    bacnet_bvlc_maintenance_timer(seconds);
+
+    /* Transaction state machine: Responsible for retransmissions and ack
+     * checking for confirmed services */
+    bacnet_tsm_timer_milliseconds(seconds * 1000);
+
+    /* Re-enables communications after DCC_Time_Duration_Seconds
+     * Required for SERVICE_CONFIRMED_DEVICE_COMMUNICATION_CONTROL
+     * bacnet_dcc_timer_seconds(seconds); */
+
+    /* State machine for load control object
+     * Required for OBJECT_LOAD_CONTROL
+     * bacnet_Load_Control_State_Machine_Handler(); */
+
+    /* Expires any COV subscribers that have finite lifetimes
+     * Required for SERVICE_CONFIRMED_SUBSCRIBE_COV */
+    bacnet_handler_cov_timer_seconds(seconds);
+
+    /* Notify subscribers of points that have gone stale. Also catches any
+     * notifications that couldn't be sent on the last pass, such as when
+     * the TSM had no free invoke ids */
+    ai_check_stale();
+    ms_tick();
+
+    /* Recalculate the diagnostics Analog Values */
+    diag_seconds += seconds;
+    if (diag_enabled && diag_seconds >= DIAG_PERIOD_S) {
+	diag_update(diag_seconds);
+	diag_seconds = 0;
+    }
+
+    /* Monitor Trend Log uLogIntervals and fetch properties
+     * Required for OBJECT_TRENDLOG
+     * bacnet_trend_log_timer(seconds); */
+
+    /* Run [Object_Type]_Intrinsic_Reporting() for all objects in device
+     * Required for INTRINSIC_REPORTING
+     * bacnet_Device_local_reporting(); */
+}
+
+/* All BACnet work is done on the main thread. The datalink socket, the 1 s
+ * and 60 s timers and COV change events are multiplexed with epoll, so packet
+ * handling and the timers never wait on each other and timer periods don't
+ * drift. The thread sleeps until one of them is ready */
+#define EVENT_DATALINK		    0
+#define EVENT_SECOND		    1
+#define EVENT_MINUTE		    2
+#define EVENT_COV		    3
+#define MAX_EVENTS		    4
+
+/* Set when COV subscribers may need notifying */
+static int cov_work;
+
+static void cov_subscribe_handler(
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src,
+		BACNET_CONFIRMED_SERVICE_DATA *service_data) {
+
+    /* libbacnet's COV subscriptions don't record the device, so only our
+     * own device's objects can be subscribed to */
+    if (current_device != bridge_devices) {
+	bacnet_handler_unrecognized_service(service_request, service_len,
+			src, service_data);
+	return;
+    }
+
+    bacnet_handler_cov_subscribe(service_request, service_len, src,
+		    service_data);
+
+    /* Send the initial notification to the new subscriber */
+    cov_work = 1;
+}
+
+/* With -i, the read handlers are timed for the diagnostics */
+static void diag_handler(bacnet_confirmed_function handler,
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src,
+		BACNET_CONFIRMED_SERVICE_DATA *service_data) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    handler(service_request, service_len, src, service_data);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    diag_add(requests, 1);
+    diag_add(handler_ns, (end.tv_sec - start.tv_sec) * 1000000000L +
+		    end.tv_nsec - start.tv_nsec);
+}
+
+static void diag_read_property(
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src,
+		BACNET_CONFIRMED_SERVICE_DATA *service_data) {
+    diag_handler(bacnet_handler_read_property, service_request,
+		    service_len, src, service_data);
+}
+
+static void diag_read_property_multiple(
+		uint8_t *service_request,
+		uint16_t service_len,
+		BACNET_ADDRESS *src,
+		BACNET_CONFIRMED_SERVICE_DATA *service_data) {
+    diag_handler(bacnet_handler_read_property_multiple, service_request,
+		    service_len, src, service_data);
+}
+
+static void event_add(int epoll_fd, int fd, uint32_t tag) {
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.u32 = tag;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+	fprintf(stderr, "Unable to add event source: %s\n", strerror(errno));
+	exit(1);
+    }
+}
+
+static int event_add_timer(int epoll_fd, time_t seconds, uint32_t tag) {
+    struct itimerspec spec;
+    int fd;
+
+    spec.it_interval.tv_sec = seconds;
+    spec.it_interval.tv_nsec = 0;
+    spec.it_value = spec.it_interval;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0 || timerfd_settime(fd, 0, &spec, NULL) < 0) {
+	fprintf(stderr, "Unable to create timer: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    event_add(epoll_fd, fd, tag);
+    return fd;
+}
+
+/* Number of periods that have elapsed since the timer was last read. More
+ * than one if the loop was held up. Also used to consume eventfd counts */
+static unsigned event_timer_expirations(int fd) {
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+	return 0;
+    return expirations;
 }
 
 #define BN_UNC(service, handler) \
@@ -421,52 +2767,302 @@ static void ms_tick(void) {
 
 
 
-int main(int argc, char **argv) {
-    uint8_t rx_buf[bacnet_MAX_MPDU];
-    uint16_t pdu_len;
+/* Handle whatever is waiting on the BACnet/IP socket, and time the samples
+ * in the replies once they have been sent */
+static void route_receive(void) {
+    static uint8_t rx_buf[bacnet_MAX_MPDU];
     BACNET_ADDRESS src;
-    pthread_t minute_tick_id, second_tick_id, modbus_new_thread_id;
+    uint16_t pdu_len;
+
+    if (batch_size && BATCH_RECEIVE) {
+	dgram_link_receive(route_npdu);
+    } else {
+	memset(&src, 0, sizeof(src));
+	pdu_len = bacnet_datalink_receive(&src, rx_buf, bacnet_MAX_MPDU, 0);
+	dgram_link_received_direct();
+
+	/* May call any registered handler */
+	if (pdu_len) route_npdu(&src, rx_buf, pdu_len);
+    }
+
+    rt_latency_sent();
+}
+
+/* The Modbus server for the read to reply benchmark, answering Read Holding
+ * Registers requests on its end of a socket pair with a new value each time */
+static void *rt_bench_modbus(void *arg) {
+    int fd = *(int *) arg;
+    uint8_t query[MB_REQUEST_LENGTH], reply[MODBUS_TCP_MAX_ADU_LENGTH];
+    uint16_t value = 0;
+    size_t len;
+    ssize_t bytes;
+    unsigned count, i;
+
+    rt_thread("benchmark Modbus", RT_MODBUS_CPU);
+
+    while (1) {
+	for (len = 0; len < sizeof(query); len += bytes)
+	    if ((bytes = read(fd, query + len, sizeof(query) - len)) <= 0)
+		return arg;
+
+	/* Same transaction, protocol and unit ids and function code */
+	count = (query[10] << 8) | query[11];
+	memcpy(reply, query, 8);
+	reply[4] = (3 + count * 2) >> 8;
+	reply[5] = (3 + count * 2) & 0xFF;
+	reply[8] = count * 2;
+	for (i = 0; i < count; i++, value++) {
+	    reply[9 + i * 2] = value >> 8;
+	    reply[10 + i * 2] = value & 0xFF;
+	}
+	if (write(fd, reply, 9 + count * 2) < 0) return arg;
+    }
+}
+
+/* Read to reply benchmark. Reads the first poll request of the point map
+ * BENCH_SAMPLES times, each time followed by a ReadProperty of the
+ * Present_Value of its first point, and reports the distribution of the
+ * time from the read until the reply has been sent. The Modbus server is a
+ * thread on the other end of a socket pair and the BACnet client a socket
+ * on loopback, so that both legs go through the same code as a live
+ * bridge's. With -r, the threads are set up as for real-time mode */
+static void rt_benchmark(void) {
+    poll_request *request = &poll_requests[0];
+    const poll_point *point = request->points[0];
+    mb_server *server = &mb_servers[request->server];
+    BACNET_READ_PROPERTY_DATA rpdata;
+    BACNET_NPDU_DATA npdu_data;
+    BACNET_ADDRESS dest;
+    struct sockaddr_in addr;
+    struct epoll_event event;
+    struct pollfd pfd;
+    struct timespec now;
+    uint8_t pdu[bacnet_MAX_MPDU + DGRAM_BVLC_HEADER];
+    uint8_t reply[bacnet_MAX_MPDU + DGRAM_BVLC_HEADER];
+    int fds[2], client_fd, len, i, replies = 0;
+    pthread_t thread;
+
+    rt_thread("BACnet", RT_BACNET_CPU);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0 ||
+	    (client_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    (mb_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	fprintf(stderr, "Unable to set up benchmark: %s\n", strerror(errno));
+	exit(1);
+    }
+    pthread_create(&thread, NULL, rt_bench_modbus, &fds[1]);
+
+    server->fd = fds[0];
+    server->state = MB_CONNECTED;
+    mb_set_events(server, EPOLLIN, EPOLL_CTL_ADD);
+
+    /* A confirmed ReadProperty, to a virtual device through our own */
+    memset(&dest, 0, sizeof(dest));
+    if (point->device) {
+	dest.net = BACNET_VIRTUAL_NETWORK;
+	dest.len = 2;
+	dest.adr[0] = point->device >> 8;
+	dest.adr[1] = point->device & 0xFF;
+    }
+    memset(&rpdata, 0, sizeof(rpdata));
+    rpdata.object_type = bacnet_OBJECT_ANALOG_INPUT;
+    rpdata.object_instance = point->instance;
+    rpdata.object_property = bacnet_PROP_PRESENT_VALUE;
+    rpdata.array_index = BACNET_ARRAY_ALL;
+
+    len = DGRAM_BVLC_HEADER;
+    bacnet_npdu_encode_npdu_data(&npdu_data, true, MESSAGE_PRIORITY_NORMAL);
+    len += bacnet_npdu_encode_pdu(&pdu[len], &dest, NULL, &npdu_data);
+    len += bacnet_rp_encode_apdu(&pdu[len], 1, &rpdata);
+    dgram_bvlc_header(pdu, len);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BACNET_PORT);
+
+    pfd.events = POLLIN;
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	mb_send(server, request, &now);
+	while (request->in_flight) {
+	    if (epoll_wait(mb_epoll_fd, &event, 1, BENCH_TIMEOUT_MS) <= 0) {
+		fprintf(stderr, "Benchmark Modbus read timed out\n");
+		exit(1);
+	    }
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    mb_receive(server, &now);
+	}
+
+	if (sendto(client_fd, pdu, len, 0, (struct sockaddr *) &addr,
+			    sizeof(addr)) < 0) {
+	    fprintf(stderr, "Unable to send benchmark request: %s\n",
+			    strerror(errno));
+	    exit(1);
+	}
+
+	pfd.fd = bacnet_bip_socket();
+	if (poll(&pfd, 1, BENCH_TIMEOUT_MS) <= 0) continue;
+	route_receive();
+
+	pfd.fd = client_fd;
+	if (poll(&pfd, 1, BENCH_TIMEOUT_MS) > 0 &&
+		recv(client_fd, reply, sizeof(reply), 0) > 0)
+	    replies++;
+    }
+
+    printf("%i reads, %i replies received\n", BENCH_SAMPLES, replies);
+    rt_report();
+
+    close(client_fd);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    close(fds[1]);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m point_map] [-b batch_size] [-l] "
+		    "[-q oldest|newest|latest] [-s snapshot] [-d] [-i] [-r] [-B]\n",
+		    program);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt, i, n, benchmark = 0;
+    int epoll_fd, second_fd, minute_fd;
+    const char *point_map = NULL, *snapshot_file = NULL;
+    char *end;
+    struct epoll_event events[MAX_EVENTS];
+    pthread_t modbus_new_thread_id, shm_thread_id;
+
+    while ((opt = getopt(argc, argv, "m:b:lq:s:dirB")) != -1) {
+	switch (opt) {
+	    case 'm':
+		point_map = optarg;
+		break;
+	    case 'b':
+		batch_size = strtoul(optarg, &end, 10);
+		if (*end || batch_size > DGRAM_BATCH_MAX) usage(argv[0]);
+		break;
+	    case 'l':
+		ai_latest_value = 1;
+		break;
+	    case 'q':
+		for (queue_policy = 0; queue_policy_names[queue_policy] &&
+			strcmp(optarg, queue_policy_names[queue_policy]);
+			queue_policy++);
+		if (!queue_policy_names[queue_policy]) usage(argv[0]);
+		break;
+	    case 's':
+		snapshot_file = optarg;
+		break;
+	    case 'd':
+		poll_adaptive = 1;
+		break;
+	    case 'i':
+		diag_enabled = 1;
+		break;
+	    case 'r':
+		rt_mode = 1;
+		break;
+	    case 'B':
+		benchmark = 1;
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
 
-    // added the modbus thread above
+    /* Lock everything allocated from here on into memory too, so the data
+     * path never takes a page fault */
+    if (rt_mode && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+	fprintf(stderr, "Unable to lock memory: %s\n", strerror(errno));
+    rt_timing = rt_mode || benchmark;
+
+    point_map_add_device(BACNET_INSTANCE_NO, NULL);
+    if (point_map) point_map_load(point_map);
+    else point_map_default();
+    point_map_index();
+    poll_build_requests();
 
     bacnet_Device_Set_Object_Instance_Number(BACNET_INSTANCE_NO);
     bacnet_address_init();
+    if (snapshot_file) snapshot_open(snapshot_file);
 
     /* Setup device objects */
     bacnet_Device_Init(server_objects);
-    BN_UNC(WHO_IS, who_is);
-    BN_CON(READ_PROPERTY, read_property);
+    bacnet_apdu_set_unconfirmed_handler(SERVICE_UNCONFIRMED_WHO_IS,
+		    route_who_is);
+    if (diag_enabled) {
+	bacnet_apdu_set_confirmed_handler(SERVICE_CONFIRMED_READ_PROPERTY,
+			diag_read_property);
+	bacnet_apdu_set_confirmed_handler(
+			SERVICE_CONFIRMED_READ_PROP_MULTIPLE,
+			diag_read_property_multiple);
+    } else {
+	BN_CON(READ_PROPERTY, read_property);
+	BN_CON(READ_PROP_MULTIPLE, read_property_multiple);
+    }
+    bacnet_apdu_set_confirmed_handler(SERVICE_CONFIRMED_SUBSCRIBE_COV,
+		    cov_subscribe_handler);
+    bacnet_handler_cov_init();
 
-    bacnet_BIP_Debug = true;
+    /* libbacnet's BIP debugging writes to stdout from the datalink */
+    bacnet_BIP_Debug = !rt_timing;
     bacnet_bip_set_port(htons(BACNET_PORT));
     bacnet_datalink_set(BACNET_DATALINK_TYPE);
     bacnet_datalink_init(BACNET_INTERFACE);
     atexit(bacnet_datalink_cleanup);
-    memset(&src, 0, sizeof(src));
+    batch_init();
+
+    route_get_my_address_direct = bacnet_datalink_get_my_address;
+    bacnet_datalink_get_my_address = route_get_my_address;
+
+    /* Signalled by the pollers, so made before they run */
+    if ((cov_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+	fprintf(stderr, "Unable to create COV event: %s\n", strerror(errno));
+	return 1;
+    }
+
+    if (benchmark) {
+	rt_benchmark();
+	return 0;
+    }
 
     register_with_bbmd();
 
-    bacnet_Send_I_Am(bacnet_Handler_Transmit_Buffer);
-    
+    if (num_bridge_devices > 1) route_send_i_am_router();
+    for (i = 0; i < num_bridge_devices; i++)
+	route_send_i_am(&bridge_devices[i]);
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	fprintf(stderr, "Unable to create epoll instance: %s\n",
+			strerror(errno));
+	return 1;
+    }
+    event_add(epoll_fd, bacnet_bip_socket(), EVENT_DATALINK);
+    second_fd = event_add_timer(epoll_fd, 1, EVENT_SECOND);
+    minute_fd = event_add_timer(epoll_fd, 60, EVENT_MINUTE);
+
+    event_add(epoll_fd, cov_event_fd, EVENT_COV);
 
-    // ======================
-    // Add a new thread
-    // =======================
-    
+    if (poll_adaptive && (poll_wake_fd =
+		    eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+	fprintf(stderr, "Unable to create modbus wake event: %s\n",
+			strerror(errno));
+	return 1;
+    }
 
-    pthread_create(&minute_tick_id, 0, minute_tick, NULL);
-    pthread_create(&second_tick_id, 0, second_tick, NULL);
-    
     /* Start another thread here to retrieve your allocated registers from the
-     * modbus server. This thread should have the following structure (in a
-     * separate function):
+     * modbus server. This thread has the following structure:
      *
      * Initialise:
      *	    Connect to the modbus server
      *
      * Loop:
-     *	    Read the required number of registers from the modbus server
-     *	    Store the register data into the tail of a linked list 
+     *	    Wait for the next poll request in poll_requests to fall due
+     *	    Read the request's block of registers from the modbus server
+     *	    Store each point's register into the tail of its sample queue
      */
 
     // =================== EDIT HERE =================== 
@@ -474,6 +3070,12 @@ int main(int argc, char **argv) {
     //
 
      pthread_create(&modbus_new_thread_id, NULL, modbus, NULL);
+     for (i = 0; i < num_mb_servers; i++) {
+	if (!mb_servers[i].shm) continue;
+	pthread_create(&shm_thread_id, NULL, shm_poll, NULL);
+	break;
+     }
+     rt_thread("BACnet", RT_BACNET_CPU);
 
 
 
@@ -485,19 +3087,38 @@ int main(int argc, char **argv) {
 
 
     while (1) {
-	pdu_len = bacnet_datalink_receive(
-		    &src, rx_buf, bacnet_MAX_MPDU, BACNET_SELECT_TIMEOUT_MS);
-
-	if (pdu_len) {
-	    /* May call any registered handler.
-	     * Thread safety: May block, however we still need to guarantee
-	     * atomicity with the timers, so hold the lock anyway */
-	    pthread_mutex_lock(&timer_lock);
-	    bacnet_npdu_handler(&src, rx_buf, pdu_len);
-	    pthread_mutex_unlock(&timer_lock);
+	/* Every source of work is an epoll event, so sleep until one is
+	 * ready. Only block if there's no COV work left over */
+	n = epoll_wait(epoll_fd, events, MAX_EVENTS, cov_work ? 0 : -1);
+
+	for (i = 0; i < n; i++) {
+	    switch (events[i].data.u32) {
+		case EVENT_DATALINK:
+		    route_receive();
+		    break;
+
+		case EVENT_SECOND:
+		    second_tick(event_timer_expirations(second_fd));
+		    break;
+
+		case EVENT_MINUTE:
+		    minute_tick(event_timer_expirations(minute_fd));
+		    break;
+
+		case EVENT_COV:
+		    event_timer_expirations(cov_event_fd);
+		    pthread_mutex_lock(&queue_lock);
+		    cov_event_pending = 0;
+		    pthread_mutex_unlock(&queue_lock);
+		    cov_work = 1;
+		    break;
+	    }
 	}
 
-	ms_tick();
+	if (cov_work) {
+	    cov_work = 0;
+	    ms_tick();
+	}
     }
 
     return 0;
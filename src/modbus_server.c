@@ -3,11 +3,15 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
 #include <modbus-tcp.h>
 
 #include "file_ops.h"
+#include "shm_regs.h"
 
 #define LISTEN_BACKLOG 1
+#define SHM_PUBLISH_INTERVAL_MS 100
 
 /* Hack:
  * libmodbus doesn't expose the context structure which is a problem for a
@@ -28,11 +32,103 @@ struct ctx_data {
 
 static modbus_mapping_t *mb_mapping;
 
+/* Serialises updates of the registers and their publication */
+static pthread_mutex_t regs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* With -s, the registers are also published to shared memory for a
+ * bacnet_server on the same host. The publisher advances the registers of
+ * each device that no Modbus client has read each SHM_PUBLISH_INTERVAL_MS,
+ * as a Modbus request would. A device's registers only advance one way, so
+ * Modbus clients see the same samples with or without -s */
+static shm_regs *shm;
+
+/* Each device's registers start at its device number */
+typedef struct device_regs_s device_regs;
+struct device_regs_s {
+    int device_id;
+    int num_regs;
+    int tcp;	    /* Advanced by Modbus requests, not the publisher */
+};
+
+static device_regs *devices;
+static int num_devices;
+
+/* Advance a device's registers to the next sample, and publish them if the
+ * device has a region entry (with -s). Called with regs_lock held */
+static void update_regs(device_regs *regs, int device) {
+    file_update_regs(mb_mapping->tab_registers, device);
+    if (!regs) return;
+
+    /* The region is sized for every device at startup */
+    if (shm_regs_write(shm, device, regs->num_regs,
+			&mb_mapping->tab_registers[device]) < 0) {
+	fprintf(stderr, "Unable to publish registers of device %i\n", device);
+	exit(1);
+    }
+}
+
+static device_regs *find_device(int device) {
+    int i;
+
+    for (i = 0; i < num_devices; i++)
+	if (devices[i].device_id == device) return &devices[i];
+    return NULL;
+}
+
+static void add_device(int device_id) {
+    device_regs *new_devices;
+
+    new_devices = realloc(devices, (num_devices + 1) * sizeof(device_regs));
+    if (!new_devices) {
+	fprintf(stderr, "Error allocating devices\n");
+	exit(1);
+    }
+    devices = new_devices;
+    devices[num_devices].device_id = device_id;
+    devices[num_devices].num_regs = file_channel_count();
+    devices[num_devices].tcp = 0;
+    num_devices++;
+}
+
+static void *publish(void *arg) {
+    struct timespec next;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+	pthread_mutex_lock(&regs_lock);
+	for (i = 0; i < num_devices; i++)
+	    if (!devices[i].tcp)
+		update_regs(&devices[i], devices[i].device_id);
+	pthread_mutex_unlock(&regs_lock);
+
+	next.tv_nsec += SHM_PUBLISH_INTERVAL_MS * 1000000L;
+	if (next.tv_nsec >= 1000000000L) {
+	    next.tv_sec++;
+	    next.tv_nsec -= 1000000000L;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    return arg;
+}
+
 static void *connection(void *arg) {
     modbus_t *ctx = (modbus_t *) arg;
+    modbus_mapping_t *reply_mapping;
     uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
-    int bytes;
+    int bytes, count;
     uint16_t device;
+    device_regs *regs;
+
+    /* Replies are made from this connection's copy of the registers, so that
+     * a slow client never holds regs_lock */
+    reply_mapping = modbus_mapping_new(0, 0, mb_mapping->nb_registers, 0);
+    if (!reply_mapping) {
+	fprintf(stderr, "Error allocating connection registers\n");
+	free(ctx);
+	return arg;
+    }
 
     while (1) {
 	bytes = modbus_receive(ctx, query);
@@ -41,23 +137,45 @@ static void *connection(void *arg) {
 	     * we can use it to update the holding registers. The project
 	     * requires that the modus address match the BACnet device no */
 	    device = (query[8] << 8) + query[9];
+	    count = (query[10] << 8) + query[11];
 	    printf("Request for device %i\n", device);
-	    file_update_regs(mb_mapping->tab_registers, device);
-	    modbus_reply(ctx, query, bytes, mb_mapping);
+	    pthread_mutex_lock(&regs_lock);
+	    if ((regs = find_device(device))) regs->tcp = 1;
+	    update_regs(regs, device);
+	    if (device + count <= mb_mapping->nb_registers)
+		memcpy(&reply_mapping->tab_registers[device],
+				&mb_mapping->tab_registers[device],
+				count * sizeof(uint16_t));
+	    pthread_mutex_unlock(&regs_lock);
+
+	    /* Out of range requests get an exception reply */
+	    modbus_reply(ctx, query, bytes, reply_mapping);
 	}
 
 	/* Other end has disconnected */
 	if (bytes == -1) break;
     }
 
+    modbus_mapping_free(reply_mapping);
     free(ctx);
     return arg;
 }
 
 int main(int argc, char *arg[]) {
     modbus_t *ctx, *dup_ctx;
-    int server_fd;
-    pthread_t tcp_thread;
+    int server_fd, opt, publish_shm = 0;
+    pthread_t tcp_thread, publish_thread;
+
+    while ((opt = getopt(argc, arg, "s")) != -1) {
+	switch (opt) {
+	    case 's':
+		publish_shm = 1;
+		break;
+	    default:
+		fprintf(stderr, "Usage: %s [-s]\n", arg[0]);
+		return 1;
+	}
+    }
 
     file_read_random_data(RANDOM_DATA_POOL);
 
@@ -68,6 +186,12 @@ int main(int argc, char *arg[]) {
 
     mb_mapping = modbus_mapping_new(0, 0, file_get_highest_channel(), 0);
 
+    if (publish_shm) {
+	file_device_enumerate(add_device);
+	shm = shm_regs_create(SHM_REGS_PATH, file_get_highest_channel());
+	pthread_create(&publish_thread, NULL, publish, NULL);
+    }
+
 listen:
     if ((server_fd = modbus_tcp_listen(ctx, LISTEN_BACKLOG)) < 0) {
 	printf("Failed to initiate modbus_tcp server, %i\n", server_fd);